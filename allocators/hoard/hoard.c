@@ -1,118 +1,427 @@
+#define _GNU_SOURCE
 #include "memlib.h"
 #include "mm_thread.h"
+#include "locks.h"
 #include <assert.h>
+#include <errno.h>
+#include <linux/mempolicy.h>
 #include <pthread.h>
 #include <stdbool.h>
 #include <stdlib.h>
-
-#define NUM_BINS 6
-#define SZ_CLASS 9
+#include <sys/mman.h>
+#include <time.h>
+
+// Per-CPU caches sit between the thread caches and the heaps: refills and
+// flushes first try the cache of the CPU they run on, which restartable
+// sequences (rseq) make safe without locks or atomics. They need x86-64 and
+// glibc 2.35 or later, which registers rseq for every thread; build with
+// -DNO_RSEQ to leave them out, or set HOARD_RSEQ=0 to turn them off. Every
+// purge empties them, which takes a membarrier rseq fence (Linux 5.10).
+#if defined(__x86_64__) && __GLIBC_PREREQ(2, 35) && !defined(NO_RSEQ)
+#define PERCPU_CACHE 1
+#include <linux/membarrier.h>
+#include <sys/rseq.h>
+#endif
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Linux 5.7 and later; older kernels reject it and large blocks get copied.
+#ifndef MREMAP_DONTUNMAP
+#define MREMAP_DONTUNMAP 4
+#endif
+
+#define NUM_BINS 6    // Fullness bins per size class, at most 8
+#define PENDING_SCAN 4 // Queued full superblocks drained per search
+
+// Superblocks are [SB_SIZE] bytes and aligned to it, so the header of any
+// block is found by masking its address. Build with -DSB_SHIFT=14..18 to pick
+// a size between 16 KiB and 256 KiB.
+#ifndef SB_SHIFT
+#define SB_SHIFT 16
+#endif
+#if SB_SHIFT < 14 || SB_SHIFT > 18
+#error "SB_SHIFT must be between 14 and 18"
+#endif
+#define SB_SIZE (1UL << SB_SHIFT)
+
+// With OOB_HEADERS, superblock headers live in a densely packed array indexed
+// by superblock number instead of at the start of each superblock. Data pages
+// then hold nothing but blocks, so frees don't dirty a shared header line in
+// them and scans over headers touch contiguous memory.
+#ifdef OOB_HEADERS
+#define SB_HEADER_SIZE 0
+#else
+#define SB_HEADER_SIZE sizeof(superblock_t)
+#endif
+
+// Size classes are 8 bytes apart up to 64 bytes and four per power of two
+// above that, so rounding a request up wastes at most ~20% of its block.
+// Requests larger than [MAX_SMALL], the largest class that fits two blocks
+// behind the header, get a hugeblock of their own.
+#define MAX_SMALL (((SB_SIZE - SB_HEADER_SIZE) / 2) & ~127UL)
+#define SZ_CLASS (8 + 4 * (SB_SHIFT - 7))
+
+// The blocks of power-of-two size classes up to [CLASS_ALIGN] bytes start on
+// a multiple of their size past the header, and so are aligned to it; aligned
+// requests up to [CLASS_ALIGN] come from the size classes. Hugeblocks serve
+// larger alignments, up to [MAX_ALIGN] by starting past their header in
+// their first superblock, and beyond that from runs carved to fit.
+#define CLASS_ALIGN 4096
+#define MAX_ALIGN (SB_HEADER_SIZE ? SB_SIZE / 2 : SB_SIZE)
+
+// Superblocks hand out blocks from a LIFO free list and a bump pointer. With
+// CHECK_BITMAP, they also keep a bitmap of allocated blocks to catch double
+// frees and cross-check the free list; debug builds enable it by default.
+#if !defined(NDEBUG) && !defined(CHECK_BITMAP)
+#define CHECK_BITMAP 1
+#endif
+
+// Thread cache tuning. Refills and flushes move roughly [CACHE_BATCH_BYTES]
+// worth of blocks at once, and a size class never caches more than
+// [CACHE_MAX_BYTES] (or [CACHE_MAX_BLOCKS] blocks) per thread.
+#define CACHE_BATCH_BYTES 4096
+#define CACHE_MAX_BYTES (64 * 1024)
+#define CACHE_MAX_BLOCKS 512
+#define CACHE_MAX_OVERFLOWS 3
+// Threads also keep up to [LARGE_CACHE_RUNS] freed hugeblocks of at most
+// [LARGE_CACHE_MAX_SBS] superblocks each for reuse.
+#define LARGE_CACHE_RUNS 8
+#define LARGE_CACHE_MAX_SBS 8
+// [mm_free_batch] groups blocks by superblock in this many slots.
+#define FREE_BATCH_GROUPS 16
+// [mm_realloc] moves large blocks of at least [REMAP_MIN_SBS] superblocks by
+// remapping their pages, and copies smaller ones.
+#define REMAP_MIN_SBS 16
+// [mm_calloc] clears blocks of [STREAM_MIN] bytes or more that aren't known
+// to be zero with non-temporal stores; below about the size of a core's L2,
+// memset wins.
+#define STREAM_MIN (2 * 1024 * 1024)
+// Each CPU caches up to [PCPU_SLOTS] blocks, and [PCPU_BYTES] bytes, per
+// size class.
+#define PCPU_SLOTS 128
+#define PCPU_BYTES (16 * 1024)
+
+// Free runs of whole superblocks are binned by length: bin [i] holds runs of
+// [i + 1] superblocks, and the last bin every longer run.
+#define RUN_BINS 64
+
+// Superblocks that sit in the free runs for [DECAY_MS] milliseconds have their
+// pages returned to the system. HOARD_DECAY_MS overrides it at startup, and 0
+// turns purging off.
+#define DECAY_MS 10000
+#define SB_PURGED 1 // sb_flags: pages returned since the superblock was used
+
+// Transparent hugepages are 2 MiB on x86-64. Superblocks are packed into the
+// fullest hugepages first. With HOARD_THP=1 the data segment is also hinted
+// for transparent hugepages, and purging then only releases whole free ones.
+#define HP_SHIFT 21
+#define HP_SIZE (1UL << HP_SHIFT)
+#define SBS_PER_HP (1U << (HP_SHIFT - SB_SHIFT))
+#define PACK_SCAN 8 // Free runs compared when picking one to allocate from
+
+// Each NUMA node gets a global heap of its own, and thread heap [i] belongs to
+// the node of CPU [i]. On machines with several nodes, hugepages of the data
+// segment are bound to the node of the heap that first grows into them.
+// Global heaps are lock-free: they keep their superblocks on one tagged stack
+// per size class and fullness bin, see [sb_stacks].
+#define MAX_NODES 64
+#define MAX_CPUS 1024
+
+// There are 2P thread heaps by default, as in the original Hoard, or as many
+// as HOARD_HEAPS says ("8", or "3p" for three per processor). A thread's
+// contention score rises by [CONTENTION_COST] whenever it finds its heap
+// locked and falls by one on every uncontended acquisition; at
+// [MIGRATE_AFTER], it moves for good to the least loaded heap of its node.
+#define CONTENTION_COST 16
+#define MIGRATE_AFTER 64
 
 #define unlikely(expr) __builtin_expect(!!(expr), 0)
 #define likely(expr) __builtin_expect(!!(expr), 1)
 
-#define GET_SZ_CLASS(x) (((x) > 8) ? log2floor(x) - 2 : 0)
-#define LOCK(x) (pthread_spin_lock(&((x)->lock)))
-#define UNLOCK(x) (pthread_spin_unlock(&((x)->lock)))
-#define TRYLOCK(x) (pthread_spin_trylock(&((x)->lock)))
-#define PAGE_ALIGN(x)                                                          \
-  (((unsigned long long)(x) >> LOG_PAGE_SIZE) << LOG_PAGE_SIZE)
+#define GET_SZ_CLASS(x)                                                        \
+  ((x) <= 1024 ? class_lo[((x) + 7) >> 3] : class_hi[((x) + 127) >> 7])
+#define LOCK(x) (lock_acquire(&((x)->lock)))
+#define UNLOCK(x) (lock_release(&((x)->lock)))
+#define TRYLOCK(x) (lock_try(&((x)->lock)))
+#define SB_ALIGN(x) ((unsigned long long)(x) & ~(SB_SIZE - 1))
+#define HP_ALIGN(x) ((unsigned long long)(x) & ~(HP_SIZE - 1))
 
 typedef struct superblock {
-  pthread_spinlock_t lock;
+  hoard_lock_t lock;
   u_int32_t in_use;
   u_int8_t bin_idx;         // Index in heap.bins[self.sz_idx]
-  u_int8_t sz_idx;          // Size class, real size is 2^(sz_idx + 3)
+  u_int8_t sz_idx;          // Size class, real size is classes[sz_idx].size
   u_int8_t heap_owner;      // The owning heap.heap_idx
+  u_int8_t pending;         // On a heap's [pending] stack
+  u_int32_t pushers;        // Remote frees under way, see [push_thread_free]
   struct superblock *next;
   struct superblock *prev;
-  u_int8_t num_pages;       // Number of pages, only for huge pages
+  u_int32_t num_sbs;        // Superblock-sized units, only for hugeblocks
+  u_int32_t pending_next;   // Next on the [pending] stack, see [pending_push]
+  // Blocks freed by threads of other heaps, linked through their first word.
+  // Pushed to without any lock and drained by whoever holds [lock].
+  void *thread_free;
+  // Freed blocks, linked through their first word. Reusing the most recently
+  // freed block first keeps allocations in cache-warm memory.
+  void *free_list;
+  // Offset into the superblock of the first block never handed out; blocks
+  // past it are carved on demand.
+  u_int32_t bump;
+  // Free runs only: decay clock when the run last gained superblocks that
+  // still hold their pages, or 0 once all of them are purged.
+  u_int32_t freed_at;
+
+#ifdef CHECK_BITMAP
+  u_int32_t bitmap_count; // Bits set in [bitmap]
 
   // Place bitmap at end of struct and aligned to a cacheline, so that when
   // the [lock] field is fetched, the prefetcher makes the bitmap be fetched
-  // by the time it's needed.
-  u_int8_t __attribute__((aligned(64))) bitmap[64];
+  // by the time it's needed. Sized for the smallest (8-byte) class.
+  u_int64_t __attribute__((aligned(64))) bitmap[SB_SIZE / 8 / 64];
+#endif
 } __attribute__((aligned(64))) superblock_t;
 
+typedef struct size_class {
+  u_int32_t size;   // Block size in bytes
+  u_int32_t offset; // Of the first block into its superblock
+  u_int32_t recip;  // ceil(2^32 / size), to divide offsets by multiplying
+  u_int32_t blocks; // Blocks per superblock
+  u_int32_t batch;  // Blocks moved per thread cache refill or flush
+  u_int32_t limit;  // Upper bound on cache_bin_t.max
+  u_int32_t pcpu;   // Capacity of its per-CPU cache bins
+} size_class_t;
+
+// Blocks of one size class cached for one CPU; only ever changed from inside
+// an rseq critical section on that CPU.
+typedef struct pcpu_bin {
+  u_int64_t count;
+  void *slots[PCPU_SLOTS];
+} pcpu_bin_t;
+
+// Intrusive stack of free blocks held by a thread; the link lives in the first
+// word of each block.
+typedef struct cache_bin {
+  void *head;
+  u_int32_t count;
+  u_int32_t max;       // Current depth limit, adapts with demand
+  u_int32_t overflows; // Flushes since the limit last changed
+} cache_bin_t;
+
+typedef struct thread_cache {
+  cache_bin_t bins[SZ_CLASS];
+  superblock_t *runs[LARGE_CACHE_RUNS]; // Freed hugeblocks, oldest first
+  u_int32_t num_runs;
+  bool registered; // Thread-exit destructor installed
+  bool disabled;   // Set once the destructor ran; blocks bypass the cache
+  u_int8_t heap;        // Heap the thread migrated to, 0 to follow its CPU
+  u_int32_t contention; // Contention score, see [MIGRATE_AFTER]
+} thread_cache_t;
+
 typedef struct heap {
   u_int8_t heap_idx;
-  int in_use;          // Bytes used; u_i in Hoard
-  int pages_allocated; // Bytes allocates in pages; a_i in Hoard
-  pthread_spinlock_t lock;
+  u_int8_t node;       // NUMA node; global heaps are heaps[0..NUM_NODES)
+  u_int16_t cpus;      // CPUs whose threads use it by default
+  u_int32_t bound;     // Threads that migrated to it
+  int64_t in_use;      // Bytes used; u_i in Hoard
+  int pages_allocated; // Superblocks held; a_i in Hoard
+  hoard_lock_t lock;
   superblock_t *bins[SZ_CLASS][NUM_BINS];  // Superblocks by size and fullness
+  u_int8_t nonempty[SZ_CLASS]; // Bit [b] set iff bins[i][b] is non-empty
+  // Totally full superblocks of each size class that remote frees have made
+  // room in since, see [pending_push].
+  u_int32_t pending[SZ_CLASS];
 } __attribute__((aligned(64))) heap_t;
 
+// Superblocks of the global heaps, indexed by node, size class and fullness
+// bin. Each stack word holds the number of its top superblock plus one (0 when
+// empty) in the low half, and in the high half a tag bumped by every push and
+// pop, so that a pop racing with others fails its compare-and-swap rather than
+// install a stale link. Superblocks on a stack are linked through [next].
+typedef u_int64_t sb_stack_t;
+static sb_stack_t (*sb_stacks)[SZ_CLASS][NUM_BINS];
+
 static int NUM_PROCS;
-static u_int64_t PAGE_SIZE;
-// Maintain the logarithm of the page size so that most operations can use a
-// shift rather than a division operation.
-static u_int64_t LOG_PAGE_SIZE;
+static int NUM_HEAPS; // Thread heaps, heaps[NUM_NODES..NUM_NODES + NUM_HEAPS)
+static int NUM_NODES = 1;
+static u_int8_t cpu_node[MAX_CPUS];
+static u_int8_t cpu_heap[MAX_CPUS]; // Thread heap serving each CPU
 static int K = 8;
 static float F = 0.25;
-static pthread_spinlock_t new_page_lock;
-static heap_t *heaps;
-static superblock_t *totally_free_superblocks = NULL;
-
-// It seems that on some machines [getTID] is very slow and accounts for 30%
-// of program time. This is not the case on others, like wolf or yelp.
-// Instead of relying on machine configuration to be in our favour, we cache
-// the computed hash in the TLS block.
+static hoard_lock_t new_page_lock;
+// Held across [purge], which locks superblocks of the global heaps without
+// their heap's lock; taken before any heap lock.
+static hoard_lock_t purge_lock;
+static heap_t *heaps; // One global heap per node, then the thread heaps
+// Free runs of superblocks, by length. A free run is described by the header
+// of its first superblock, with [num_sbs] set to its length. Protected by
+// [new_page_lock].
+static superblock_t *free_runs[RUN_BINS];
+static u_int64_t free_runs_mask; // Bit [i] set iff free_runs[i] is non-empty
+// Boundary tags, indexed by superblock number: the entries of the first and
+// last superblock of a free run of [len] superblocks hold (len << 1) | 1, the
+// entries at either end of any other run hold 0.
+static u_int32_t *run_tags;
+static u_int8_t *sb_flags; // Indexed by superblock number
+static u_int16_t *hp_free; // Superblocks in the free runs, by hugepage number
+static u_int8_t *hp_node;  // With NUM_NODES > 1: bound node + 1, or 0
+static bool use_thp;
+static char *sb_top;   // End of the memory obtained from [mem_sbrk]
+static char *sb_limit; // End of the memory the per-superblock state covers
+static pthread_key_t cache_key;
+static char *sb_base;         // Address of superblock number 0
+#ifdef OOB_HEADERS
+static superblock_t *sb_meta; // Header of superblock [n] is [sb_meta[n]]
+#endif
+static size_class_t classes[SZ_CLASS];
+// Per-CPU cache bins, [SZ_CLASS] for each of [pcpu_cpus] CPUs; NULL when
+// per-CPU caching is off.
+static pcpu_bin_t *pcpu_base;
+#ifdef PERCPU_CACHE
+static u_int32_t pcpu_cpus;
+static u_int8_t pcpu_stopped; // Set while [pcpu_drain] empties the bins
+static bool pcpu_fence;       // Registered for membarrier rseq fences
+#endif
+static u_int32_t decay_ms = DECAY_MS;
+static u_int32_t purge_last;    // Decay clock at the last purge
+static u_int64_t purged_bytes;  // Returned to the system, under new_page_lock
+static u_int64_t faulted_bytes; // Purged memory handed out again
+static u_int64_t migrations;    // Threads that moved heaps under contention
+// Size class lookup tables, indexed by the request size rounded up to 8 bytes
+// for sizes up to 1024, and to 128 bytes up to [MAX_SMALL].
+static u_int8_t class_lo[1024 / 8 + 1];
+static u_int8_t class_hi[MAX_SMALL / 128 + 1];
+static __thread thread_cache_t tls_cache;
+
+// Threads use the heap of the CPU they are running on, so a thread that
+// migrates follows its new core's cache, unless contention made them move to
+// a heap of their own. glibc reads the CPU number from the thread's rseq
+// area, which is cheap enough for every slow path. Should that fail, fall
+// back to hashing the TID, cached in the TLS block since [getTID] is a
+// system call.
 __thread int tls_hash = 0;
 static inline int hash() {
-  return tls_hash ? tls_hash : (tls_hash = (getTID() % NUM_PROCS) + 1);
+  if (tls_cache.heap)
+    return tls_cache.heap;
+  int cpu = sched_getcpu();
+  if (likely(cpu >= 0))
+    return cpu_heap[cpu % MAX_CPUS];
+  return tls_hash ? tls_hash
+                  : (tls_hash = (getTID() % NUM_HEAPS) + NUM_NODES);
+}
+
+// The global heap of the node [heap] belongs to.
+static inline heap_t *global_heap(heap_t *heap) { return &heaps[heap->node]; }
+
+static inline bool is_global(heap_t *heap) {
+  return heap->heap_idx < NUM_NODES;
 }
 
 static inline int log2floor(u_int64_t sz) {
   return sizeof(u_int64_t) * 8 - 1 - __builtin_clzll(sz);
 }
 
-#define to_log_size(idx) (3 + (idx))
-static inline u_int64_t to_size(int idx) { return 1ULL << to_log_size(idx); }
+static inline u_int64_t to_size(int idx) { return classes[idx].size; }
 
-static inline int num_blocks(int sz_idx) {
-  // This shift is just division by [to_size(sz_idx)], but GCC isn't smart
-  // enough to realize that [to_size] is always a power of two and turn it
-  // into a shift itself.
-  return (PAGE_SIZE - sizeof(superblock_t)) >> to_log_size(sz_idx);
-}
+static inline int num_blocks(int sz_idx) { return classes[sz_idx].blocks; }
 
-static inline bool is_hugeblock(superblock_t *sb) { return sb->num_pages > 0; }
+static inline bool is_hugeblock(superblock_t *sb) { return sb->num_sbs > 0; }
 
-static inline u_int64_t bitmask_idx(void *ptr, superblock_t *sb) {
-  u_int64_t offset = ((unsigned long long)ptr) - (unsigned long long)sb;
-  assert(offset >= sizeof(superblock_t));
+// Header of the superblock containing [ptr].
+static inline superblock_t *sb_of(void *ptr) {
+#ifdef OOB_HEADERS
+  return &sb_meta[((char *)ptr - sb_base) >> SB_SHIFT];
+#else
+  return (superblock_t *)SB_ALIGN(ptr);
+#endif
+}
 
-  int ret = (offset - sizeof(superblock_t)) >> to_log_size(sb->sz_idx);
-  assert(ret >= 0);
-  return ret;
+// Start of the SB_SIZE bytes of memory described by [sb].
+static inline char *sb_start(superblock_t *sb) {
+#ifdef OOB_HEADERS
+  return sb_base + ((sb - sb_meta) << SB_SHIFT);
+#else
+  return (char *)sb;
+#endif
 }
 
-static inline int next_block(superblock_t *sb, int blocks_per_sb) {
-  // Access bitmap as 64-bit words for fewer loop jumps. This is safe to do
-  // because the bitmap is aligned on a 64-byte boundary.
-  u_int64_t *lb = (u_int64_t *)sb->bitmap;
+// First byte of [sb] past its header, where hugeblocks start by default.
+static inline char *sb_data(superblock_t *sb) {
+  return sb_start(sb) + SB_HEADER_SIZE;
+}
 
-  for (int i = 0; i < 64 / sizeof(u_int64_t); i++) {
-    int j = __builtin_ffsll(~lb[i]);
-    if (j == 0)
-      continue;
+// Header of the block at [ptr] the program got from us. With headers in
+// place, only a hugeblock aligned to a superblock boundary can start right
+// on one, and its header sits in the superblock before it.
+static inline superblock_t *block_sb(void *ptr) {
+#ifdef OOB_HEADERS
+  return sb_of(ptr);
+#else
+  return sb_of((char *)ptr - !((uintptr_t)ptr & (SB_SIZE - 1)));
+#endif
+}
 
-    int block = i * 8 * sizeof(u_int64_t) + j - 1;
-    if (block >= blocks_per_sb)
-      return -1;
-    return block;
-  }
+static inline u_int64_t bitmask_idx(void *ptr, superblock_t *sb) {
+  char *first = sb_start(sb) + classes[sb->sz_idx].offset;
+  assert((char *)ptr >= first);
+  u_int64_t offset = (char *)ptr - first;
+
+  // Multiplying by the rounded-up reciprocal is exact division for offsets
+  // that are a multiple of the block size below 2^32, which block offsets
+  // always are.
+  u_int64_t ret = (offset * classes[sb->sz_idx].recip) >> 32;
+  assert(ret * to_size(sb->sz_idx) == offset);
+  return ret;
+}
 
-  return -1;
+#ifdef CHECK_BITMAP
+// Mark [ptr] allocated in the bitmap of [sb].
+static inline void bitmap_set(superblock_t *sb, void *ptr) {
+  u_int64_t idx = bitmask_idx(ptr, sb);
+  assert(idx < num_blocks(sb->sz_idx));
+  assert(!(sb->bitmap[idx / 64] & (1ULL << (idx % 64))));
+  sb->bitmap[idx / 64] |= (1ULL << (idx % 64));
+  sb->bitmap_count++;
 }
 
+// Mark [ptr] free in the bitmap of [sb], catching double frees.
+static inline void bitmap_clear(superblock_t *sb, void *ptr) {
+  u_int64_t idx = bitmask_idx(ptr, sb);
+  assert(sb->bitmap[idx / 64] & (1ULL << (idx % 64)));
+  sb->bitmap[idx / 64] &= ~(1ULL << (idx % 64));
+  sb->bitmap_count--;
+}
+#else
+#define bitmap_set(sb, ptr) ((void)0)
+#define bitmap_clear(sb, ptr) ((void)0)
+#endif
+
 static inline bool is_superblock_full(superblock_t *sb, int sz_class_idx) {
-  int ret =
-      sb->in_use + to_size(sz_class_idx) > (PAGE_SIZE - sizeof(superblock_t));
-  assert((next_block(sb, num_blocks(sz_class_idx)) == -1) == ret);
+  int ret = sb->in_use + to_size(sz_class_idx) >
+            SB_SIZE - classes[sz_class_idx].offset;
+#ifdef CHECK_BITMAP
+  assert(sb->bitmap_count * to_size(sz_class_idx) == sb->in_use);
+#endif
   return ret;
 }
 
+// Fullness bin [sb] belongs in. We use a special bin to denote totally full
+// blocks.
+static inline int fullness_bin(superblock_t *sb) {
+  return is_superblock_full(sb, sb->sz_idx)
+             ? NUM_BINS - 1
+             : ((NUM_BINS - 1) * sb->in_use) >> SB_SHIFT;
+}
+
+static inline void link_superblock(superblock_t **head, superblock_t *sb) {
+  sb->prev = NULL;
+  sb->next = *head;
+  if (sb->next)
+    sb->next->prev = sb;
+  *head = sb;
+}
+
 static inline void unlink_superblock(superblock_t **head, superblock_t *sb) {
   if (*head == sb)
     *head = sb->next;
@@ -122,77 +431,665 @@ static inline void unlink_superblock(superblock_t **head, superblock_t *sb) {
     sb->next->prev = sb->prev;
 }
 
-static inline void *create_new_hugeblock(size_t sz) {
-  int num_pages = (sz / (PAGE_SIZE - sizeof(superblock_t))) + 1;
-  pthread_spin_lock(&new_page_lock);
-  superblock_t *sb = (superblock_t *)mem_sbrk(PAGE_SIZE * num_pages);
-  pthread_spin_unlock(&new_page_lock);
-  sb->num_pages = num_pages;
+// Number of the superblock containing [ptr].
+static inline u_int64_t sb_index(void *ptr) {
+  return ((char *)ptr - sb_base) >> SB_SHIFT;
+}
+
+// Header of superblock number [idx].
+static inline superblock_t *sb_at(u_int64_t idx) {
+  return sb_of(sb_base + (idx << SB_SHIFT));
+}
+
+// Stack word with [top] on top, one tag past [old].
+static inline sb_stack_t stack_word(sb_stack_t old, superblock_t *top) {
+  return ((old >> 32) + 1) << 32 | (top ? sb_index(sb_start(top)) + 1 : 0);
+}
+
+static inline superblock_t *stack_top(sb_stack_t word) {
+  return (u_int32_t)word ? sb_at((u_int32_t)word - 1) : NULL;
+}
+
+// Push [sb], which no other thread may reach, onto [stack].
+static void stack_push(sb_stack_t *stack, superblock_t *sb) {
+  sb_stack_t old = __atomic_load_n(stack, __ATOMIC_RELAXED);
+  do {
+    sb->next = stack_top(old);
+  } while (!__atomic_compare_exchange_n(stack, &old, stack_word(old, sb), true,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+// Pop the top superblock of [stack], or return NULL if it is empty. Headers
+// are never unmapped, so reading the link of a superblock that another thread
+// popped in the meantime is harmless; the tag makes the exchange fail.
+static superblock_t *stack_pop(sb_stack_t *stack) {
+  sb_stack_t old = __atomic_load_n(stack, __ATOMIC_ACQUIRE);
+  superblock_t *sb;
+  do {
+    sb = stack_top(old);
+    if (sb == NULL)
+      return NULL;
+  } while (!__atomic_compare_exchange_n(
+      stack, &old,
+      stack_word(old, __atomic_load_n(&sb->next, __ATOMIC_RELAXED)), true,
+      __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+  return sb;
+}
+
+// Empty [stack] at once, returning its superblocks linked through [next].
+static superblock_t *stack_take(sb_stack_t *stack) {
+  sb_stack_t old = __atomic_load_n(stack, __ATOMIC_ACQUIRE);
+  do {
+    if (stack_top(old) == NULL)
+      return NULL;
+  } while (!__atomic_compare_exchange_n(stack, &old, stack_word(old, NULL),
+                                        true, __ATOMIC_ACQUIRE,
+                                        __ATOMIC_ACQUIRE));
+  return stack_top(old);
+}
+
+// Number of the hugepage containing [ptr].
+static inline u_int64_t hp_index(void *ptr) {
+  return ((u_int64_t)ptr >> HP_SHIFT) - ((u_int64_t)sb_base >> HP_SHIFT);
+}
+
+// Add [delta] times the superblocks in [start, end) to the free counts of
+// the hugepages they lie in.
+static inline void hp_account(char *start, char *end, int delta) {
+  while (start < end) {
+    char *next = (char *)HP_ALIGN(start) + HP_SIZE;
+    if (next > end)
+      next = end;
+    hp_free[hp_index(start)] += delta * (int)((next - start) >> SB_SHIFT);
+    start = next;
+  }
+}
+
+// Milliseconds from an arbitrary start, wrapping, and never 0. The coarse
+// clock is cheap enough to read on slow paths.
+static inline u_int32_t decay_clock(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+  u_int32_t ms = ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+  return ms ? ms : 1;
+}
+
+static inline int run_bin(u_int32_t len) {
+  return len >= RUN_BINS ? RUN_BINS - 1 : len - 1;
+}
+
+// Add the free run of [len] superblocks at [start], unpurged since
+// [freed_at], to its bin and tag its ends. [new_page_lock] must be held.
+static void insert_run(char *start, u_int32_t len, u_int32_t freed_at) {
+  superblock_t *sb = sb_of(start);
+  int bin = run_bin(len);
+  sb->num_sbs = len;
+  sb->freed_at = freed_at;
+  sb->prev = NULL;
+  sb->next = free_runs[bin];
+  if (sb->next)
+    sb->next->prev = sb;
+  free_runs[bin] = sb;
+  free_runs_mask |= 1ULL << bin;
+
+  u_int64_t idx = sb_index(start);
+  run_tags[idx] = run_tags[idx + len - 1] = (len << 1) | 1;
+}
+
+// Take the free run described by [sb] out of its bin. [new_page_lock] must be
+// held.
+static void remove_run(superblock_t *sb) {
+  int bin = run_bin(sb->num_sbs);
+  unlink_superblock(&free_runs[bin], sb);
+  if (free_runs[bin] == NULL)
+    free_runs_mask &= ~(1ULL << bin);
+
+  u_int64_t idx = sb_index(sb_start(sb));
+  run_tags[idx] = run_tags[idx + sb->num_sbs - 1] = 0;
+#ifndef OOB_HEADERS
+  // A purged superblock reads as zero, bar the header the run kept in it;
+  // it may end up in the middle of a hugeblock.
+  if (sb_flags[idx] & SB_PURGED)
+    memset(sb, 0, SB_HEADER_SIZE);
+#endif
+}
+
+// Of two decay clock readings (0 for none), the one furthest before [now].
+static inline u_int32_t decay_oldest(u_int32_t now, u_int32_t a, u_int32_t b) {
+  if (a == 0)
+    return b;
+  return b == 0 || now - a > now - b ? a : b;
+}
+
+// Return [len] superblocks at [start] to the free runs, merging them with
+// free neighbours on either side. A merged run decays from its oldest
+// unpurged part, so steady frees next to an idle run can't keep postponing
+// its purge. [new_page_lock] must be held.
+static void free_run(char *start, u_int32_t len) {
+  u_int64_t idx = sb_index(start);
+  u_int32_t now = decay_clock(), freed_at = now;
+  assert(!(run_tags[idx] & 1) && !(run_tags[idx + len - 1] & 1));
+  hp_account(start, start + (u_int64_t)len * SB_SIZE, 1);
+  if (idx > 0 && (run_tags[idx - 1] & 1)) {
+    char *left = start - (u_int64_t)(run_tags[idx - 1] >> 1) * SB_SIZE;
+    freed_at = decay_oldest(now, freed_at, sb_of(left)->freed_at);
+    remove_run(sb_of(left));
+    len += (start - left) >> SB_SHIFT;
+    start = left;
+  }
+
+  char *end = start + (u_int64_t)len * SB_SIZE;
+  if (end < sb_top && (run_tags[sb_index(end)] & 1)) {
+    superblock_t *right = sb_of(end);
+    freed_at = decay_oldest(now, freed_at, right->freed_at);
+    len += right->num_sbs;
+    remove_run(right);
+  }
+
+  insert_run(start, len, freed_at);
+}
+
+// Mark the [len] superblocks at [start] as handed out again, counting any
+// purged ones the program is about to fault back in. Returns whether all of
+// them were, and so read as zero.
+static inline bool claim_run(char *start, u_int32_t len) {
+  u_int8_t *flags = &sb_flags[sb_index(start)];
+  u_int32_t purged = 0;
+  hp_account(start, start + (u_int64_t)len * SB_SIZE, -1);
+  for (u_int32_t i = 0; i < len; i++) {
+    if (flags[i] & SB_PURGED) {
+      flags[i] &= ~SB_PURGED;
+      purged++;
+    }
+  }
+  faulted_bytes += (u_int64_t)purged * SB_SIZE;
+  return purged == len;
+}
+
+// Return the pages of every superblock of the free run [sb] that still has
+// them to the system; with hugepages, only of those filling whole free
+// hugepages, so that no partially used one is broken up. Unless OOB_HEADERS,
+// the page holding the run header is kept, and only its tail cleared.
+// [new_page_lock] must be held.
+static void purge_run(superblock_t *sb) {
+  char *start = sb_start(sb);
+  u_int8_t *flags = &sb_flags[sb_index(start)];
+  u_int32_t len = sb->num_sbs;
+
+  for (u_int32_t i = 0, j; i < len; i = j) {
+    for (j = i; j < len && !(flags[j] & SB_PURGED); j++)
+      ;
+    char *lo = start + (u_int64_t)i * SB_SIZE;
+    char *hi = start + (u_int64_t)j * SB_SIZE;
+    if (use_thp) {
+      lo = (char *)HP_ALIGN(lo + HP_SIZE - 1);
+      hi = (char *)HP_ALIGN(hi);
+    }
+    if (lo < hi) {
+      size_t keep = 0;
+      if (lo == start && SB_HEADER_SIZE) {
+        keep = (SB_HEADER_SIZE + mem_pagesize() - 1) & ~(mem_pagesize() - 1);
+        memset(start + SB_HEADER_SIZE, 0, keep - SB_HEADER_SIZE);
+      }
+      if (mem_release(lo + keep, hi - lo - keep) == 0) {
+        memset(&flags[(lo - start) >> SB_SHIFT], SB_PURGED,
+               (hi - lo) >> SB_SHIFT);
+        purged_bytes += hi - lo;
+      }
+    }
+    for (; j < len && (flags[j] & SB_PURGED); j++)
+      ;
+  }
+  sb->freed_at = 0;
+}
+
+// How badly the free run [r] suits an allocation for [node]: runs on other
+// nodes come last, then runs in emptier hugepages.
+static inline u_int32_t pack_cost(superblock_t *r, int node) {
+  u_int64_t hp = hp_index(sb_start(r));
+  u_int32_t cost = hp_free[hp];
+  if (NUM_NODES > 1 && hp_node[hp] != node + 1)
+    cost += SBS_PER_HP + 1;
+  return cost;
+}
+
+// Among the first few runs of [head], the one lying in the fullest
+// hugepage of [node], so that mostly empty hugepages drain and can be purged
+// whole.
+static superblock_t *pack_run(superblock_t *head, int node) {
+  superblock_t *best = head;
+  u_int32_t best_cost = pack_cost(head, node);
+  int n = 0;
+  for (superblock_t *r = head->next; r && ++n < PACK_SCAN; r = r->next) {
+    u_int32_t cost = pack_cost(r, node);
+    if (cost < best_cost) {
+      best = r;
+      best_cost = cost;
+    }
+  }
+  return best;
+}
+
+// Bind the hugepages first reached by growing the data segment to [start,
+// end) to [node]. Binding whole hugepages keeps the number of mappings low.
+static void bind_run(char *start, char *end, int node) {
+  unsigned long mask = 1UL << node;
+  for (char *hp = (char *)HP_ALIGN(start); hp < end; hp += HP_SIZE) {
+    u_int64_t idx = hp_index(hp);
+    if (hp_node[idx])
+      continue;
+    hp_node[idx] = node + 1;
+    char *hi = hp + HP_SIZE < dseg_lo + dseg_size ? hp + HP_SIZE
+                                                   : dseg_lo + dseg_size;
+    syscall(SYS_mbind, hp, hi - hp, MPOL_PREFERRED, &mask, MAX_NODES + 1, 0);
+  }
+}
+
+// Carve [len] contiguous superblocks out of the free runs, growing the data
+// segment if none is long enough; [node] is the NUMA node to favour. Returns
+// their start, or NULL when out of memory, and unless [zero] is NULL, sets
+// [*zero] if they are known to read as zero: fresh from [mem_sbrk], or
+// purged. [new_page_lock] must be held.
+static char *alloc_run(u_int32_t len, int node, bool *zero) {
+  bool fresh = true;
+  superblock_t *sb = NULL;
+  u_int64_t mask = free_runs_mask & (~0ULL << run_bin(len));
+  if (mask) {
+    int bin = __builtin_ctzll(mask);
+    if (bin < RUN_BINS - 1) {
+      sb = pack_run(free_runs[bin], node);
+    } else {
+      // Runs in the last bin vary in length, so pick the best fit.
+      for (superblock_t *r = free_runs[bin]; r; r = r->next)
+        if (r->num_sbs >= len && (sb == NULL || r->num_sbs < sb->num_sbs))
+          sb = r;
+    }
+  }
+
+  if (sb) {
+    char *start = sb_start(sb);
+    u_int32_t have = sb->num_sbs, freed_at = sb->freed_at;
+    remove_run(sb);
+    if (have > len)
+      insert_run(start + (u_int64_t)len * SB_SIZE, have - len, freed_at);
+    fresh = claim_run(start, len);
+    if (zero)
+      *zero = fresh;
+    return start;
+  }
+
+  // Grow the data segment, reusing a free run that ends at the top of it.
+  char *start = sb_top;
+  u_int32_t need = len;
+  if (sb_top + (u_int64_t)len * SB_SIZE > sb_limit)
+    return NULL;
+  if (sb_top > sb_base && (run_tags[sb_index(sb_top) - 1] & 1)) {
+    u_int32_t top_len = run_tags[sb_index(sb_top) - 1] >> 1;
+    start = sb_top - (u_int64_t)top_len * SB_SIZE;
+    need -= top_len;
+    if (mem_sbrk((u_int64_t)need * SB_SIZE) == NULL)
+      return NULL;
+    remove_run(sb_of(start));
+    fresh = claim_run(start, top_len);
+  } else if (mem_sbrk((u_int64_t)need * SB_SIZE) == NULL) {
+    return NULL;
+  }
+  if (NUM_NODES > 1)
+    bind_run(sb_top, sb_top + (u_int64_t)need * SB_SIZE, node);
+  sb_top += (u_int64_t)need * SB_SIZE;
+  if (zero)
+    *zero = fresh;
+  return start;
+}
+
+// Extend the run of superblocks ending at [end] by the [len] that follow it,
+// taking them from a free run starting there or, where the data segment ends
+// first, by growing it; [node] is as for [alloc_run]. Returns false if they
+// aren't all free. [new_page_lock] must be held.
+static bool extend_run(char *end, u_int32_t len, int node) {
+  u_int32_t have = 0, freed_at = 0;
+  if (end < sb_top && (run_tags[sb_index(end)] & 1)) {
+    have = run_tags[sb_index(end)] >> 1;
+    freed_at = sb_of(end)->freed_at;
+  }
+
+  u_int32_t grow = have < len ? len - have : 0;
+  if (grow && (end + (u_int64_t)have * SB_SIZE != sb_top ||
+               sb_top + (u_int64_t)grow * SB_SIZE > sb_limit ||
+               mem_sbrk((u_int64_t)grow * SB_SIZE) == NULL))
+    return false;
+
+  if (have) {
+    remove_run(sb_of(end));
+    if (have > len)
+      insert_run(end + (u_int64_t)len * SB_SIZE, have - len, freed_at);
+    claim_run(end, have < len ? have : len);
+  }
+  if (grow) {
+    if (NUM_NODES > 1)
+      bind_run(sb_top, sb_top + (u_int64_t)grow * SB_SIZE, node);
+    sb_top += (u_int64_t)grow * SB_SIZE;
+  }
+  return true;
+}
+
+static void purge_tick(void);
+
+static inline void cache_register(void) {
+  if (unlikely(!tls_cache.registered)) {
+    tls_cache.registered = true;
+    pthread_setspecific(cache_key, &tls_cache);
+  }
+}
+
+// Superblocks in the run of a hugeblock of [sz] bytes that start [off] bytes
+// into it. Only valid once [hugeblock_fits] said yes.
+static inline u_int32_t hugeblock_sbs(size_t off, size_t sz) {
+  return (off + sz + SB_SIZE - 1) >> SB_SHIFT;
+}
+
+// Whether a hugeblock of [sz] bytes starting [off] bytes into its run could
+// fit in the data segment at all; sets errno to ENOMEM if not. Checked before
+// [hugeblock_sbs], which would otherwise wrap around for absurd sizes.
+static inline bool hugeblock_fits(size_t off, size_t sz) {
+  if (unlikely(sz > (size_t)(sb_limit - sb_base) - off)) {
+    errno = ENOMEM;
+    return false;
+  }
+  return true;
+}
+
+// A hugeblock of [sz] bytes starting [off] bytes into its run, which is at
+// least SB_HEADER_SIZE and less than SB_SIZE; NULL with errno set to ENOMEM
+// when out of memory. Unless [zero] is NULL, [*zero] is set if its memory is
+// known to read as zero.
+static inline void *create_new_hugeblock(size_t sz, size_t off, bool *zero) {
+  if (zero)
+    *zero = false;
+  if (!hugeblock_fits(off, sz))
+    return NULL;
+  u_int32_t num_sbs = hugeblock_sbs(off, sz);
+
+  // Reuse a hugeblock of the same size this thread freed recently.
+  thread_cache_t *cache = &tls_cache;
+  for (u_int32_t i = 0; i < cache->num_runs; i++) {
+    superblock_t *sb = cache->runs[i];
+    if (sb->num_sbs == num_sbs) {
+      cache->num_runs--;
+      memmove(&cache->runs[i], &cache->runs[i + 1],
+              (cache->num_runs - i) * sizeof(superblock_t *));
+      return sb_start(sb) + off;
+    }
+  }
+
+  lock_acquire(&new_page_lock);
+  char *mem = alloc_run(num_sbs, heaps[hash()].node, zero);
+  lock_release(&new_page_lock);
+  purge_tick();
+  if (mem == NULL) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  superblock_t *sb = sb_of(mem);
+  sb->num_sbs = num_sbs;
+
+  return mem + off;
+}
 
-  return (char *)sb + sizeof(superblock_t);
+// A hugeblock of [sz] bytes aligned to [align], a power of two above
+// [MAX_ALIGN]. Its run is carved out of one with room to spare for the
+// alignment, which goes back to the free runs on either side. With headers
+// in place, the block starts a whole superblock in, so that [block_sb] finds
+// the header in front of it.
+static void *create_aligned_hugeblock(size_t sz, size_t align) {
+  size_t off = SB_HEADER_SIZE ? SB_SIZE : 0;
+  size_t slack = align - SB_SIZE;
+  if (slack > (size_t)(sb_limit - sb_base) - off) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  if (!hugeblock_fits(off + slack, sz))
+    return NULL;
+  u_int32_t num_sbs = hugeblock_sbs(off, sz);
+  u_int32_t extra = slack >> SB_SHIFT;
+
+  char *start = NULL;
+  lock_acquire(&new_page_lock);
+  char *mem = alloc_run(num_sbs + extra, heaps[hash()].node, NULL);
+  if (mem) {
+    start = (char *)(((uintptr_t)mem + off + slack) & ~(align - 1)) - off;
+    u_int32_t head = (start - mem) >> SB_SHIFT;
+    if (head)
+      free_run(mem, head);
+    if (head < extra)
+      free_run(start + ((u_int64_t)num_sbs << SB_SHIFT), extra - head);
+    sb_of(start)->num_sbs = num_sbs;
+  }
+  lock_release(&new_page_lock);
+  purge_tick();
+  if (start == NULL) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  return start + off;
 }
 
 static inline void free_hugeblock(superblock_t *sb) {
-  int num_pages = sb->num_pages;
+  thread_cache_t *cache = &tls_cache;
+  if (sb->num_sbs <= LARGE_CACHE_MAX_SBS && !cache->disabled) {
+    cache_register();
+    superblock_t *evicted = NULL;
+    if (cache->num_runs == LARGE_CACHE_RUNS) {
+      evicted = cache->runs[0];
+      cache->num_runs--;
+      memmove(&cache->runs[0], &cache->runs[1],
+              cache->num_runs * sizeof(superblock_t *));
+    }
+    cache->runs[cache->num_runs++] = sb;
+    if (evicted == NULL)
+      return;
+    sb = evicted;
+  }
+
+  lock_acquire(&new_page_lock);
+  free_run(sb_start(sb), sb->num_sbs);
+  lock_release(&new_page_lock);
+  purge_tick();
+}
 
-  pthread_spin_lock(&new_page_lock);
-  for (int i = 0; i < num_pages; i++) {
-    superblock_t *new_sb = (((char *)sb) + (PAGE_SIZE * i));
-    new_sb->next = totally_free_superblocks;
-    new_sb->prev = NULL;
+// Resize the hugeblock at [ptr] in place to [sz] bytes: its surplus
+// superblocks go back to the free runs, and missing ones come from those right
+// after it. Returns false if they aren't free.
+static bool resize_hugeblock(void *ptr, size_t sz) {
+  superblock_t *sb = block_sb(ptr);
+  char *start = sb_start(sb);
+  u_int32_t len = sb->num_sbs;
+  if (!hugeblock_fits((char *)ptr - start, sz))
+    return false;
+  u_int32_t num_sbs = hugeblock_sbs((char *)ptr - start, sz);
+  if (num_sbs == len)
+    return true;
+
+  bool ok = true;
+  lock_acquire(&new_page_lock);
+  if (num_sbs < len)
+    free_run(start + (u_int64_t)num_sbs * SB_SIZE, len - num_sbs);
+  else
+    ok = extend_run(start + (u_int64_t)len * SB_SIZE, num_sbs - len,
+                    heaps[hash()].node);
+  if (ok)
+    sb->num_sbs = num_sbs;
+  lock_release(&new_page_lock);
+  if (num_sbs < len)
+    purge_tick();
+  return ok;
+}
 
-    if (new_sb->next)
-      new_sb->next->prev = new_sb;
-    totally_free_superblocks = new_sb;
+// Move the contents of the hugeblock [from] to the larger one [to] by
+// remapping its pages instead of copying them; only the part of the first
+// page behind the header is copied. [from] stays mapped, and the superblocks
+// it no longer holds anything in count as purged. Returns false if the kernel
+// can't remap, e.g. as it predates MREMAP_DONTUNMAP.
+static bool remap_hugeblock(superblock_t *from, superblock_t *to) {
+  size_t keep = (SB_HEADER_SIZE + mem_pagesize() - 1) & ~(mem_pagesize() - 1);
+  size_t len = ((size_t)from->num_sbs << SB_SHIFT) - keep;
+  char *src = sb_start(from), *dst = sb_start(to);
+  if (mremap(src + keep, len, len,
+             MREMAP_MAYMOVE | MREMAP_FIXED | MREMAP_DONTUNMAP,
+             dst + keep) == MAP_FAILED)
+    return false;
+  memcpy(dst + SB_HEADER_SIZE, src + SB_HEADER_SIZE, keep - SB_HEADER_SIZE);
+
+  // With headers in place, the first superblock keeps that of [from].
+  u_int32_t first = keep ? 1 : 0;
+  lock_acquire(&new_page_lock);
+  memset(&sb_flags[sb_index(src) + first], SB_PURGED, from->num_sbs - first);
+  purged_bytes += (u_int64_t)(from->num_sbs - first) * SB_SIZE;
+  lock_release(&new_page_lock);
+  return true;
+}
+
+// Queue [sb], a totally full superblock of [heap] that got a remote free, to
+// be drained by the next search of [heap] for a superblock of its size class.
+// Each size class of a heap has a lock-free stack of them, linked through
+// [pending_next] by superblock number + 1. Only the holder of the heap lock
+// pops, so the stacks need no ABA tag, and a superblock is on at most one
+// stack at a time. As it cannot be unlinked from there, it must not return to
+// the free runs until popped.
+static void pending_push(heap_t *heap, superblock_t *sb) {
+  if (__atomic_exchange_n(&sb->pending, 1, __ATOMIC_ACQ_REL))
+    return;
+  u_int32_t *stack = &heap->pending[sb->sz_idx];
+  u_int32_t old = __atomic_load_n(stack, __ATOMIC_RELAXED);
+  do {
+    sb->pending_next = old;
+  } while (!__atomic_compare_exchange_n(stack, &old,
+                                        sb_index(sb_start(sb)) + 1, true,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+// Pop a superblock queued by [pending_push]. [heap] must be locked.
+static superblock_t *pending_pop(heap_t *heap, int sz_class_idx) {
+  u_int32_t *stack = &heap->pending[sz_class_idx];
+  u_int32_t old = __atomic_load_n(stack, __ATOMIC_ACQUIRE);
+  do {
+    if (old == 0)
+      return NULL;
+  } while (!__atomic_compare_exchange_n(
+      stack, &old, sb_at(old - 1)->pending_next, true, __ATOMIC_ACQUIRE,
+      __ATOMIC_ACQUIRE));
+  return sb_at(old - 1);
+}
+
+// Link [sb] at the front of fullness bin [bin] of [heap], which must be
+// locked. A superblock entering the totally full bin with a remote free
+// already pending is queued right away, as its pusher may have missed it.
+static inline void bin_insert(heap_t *heap, superblock_t *sb, int bin) {
+  sb->bin_idx = bin;
+  link_superblock(&heap->bins[sb->sz_idx][bin], sb);
+  heap->nonempty[sb->sz_idx] |= 1U << bin;
+  if (bin == NUM_BINS - 1) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&sb->thread_free, __ATOMIC_RELAXED))
+      pending_push(heap, sb);
+  }
+}
+
+// Unlink [sb] from its fullness bin of [heap], which must be locked.
+static inline void bin_remove(heap_t *heap, superblock_t *sb) {
+  superblock_t **head = &heap->bins[sb->sz_idx][sb->bin_idx];
+  unlink_superblock(head, sb);
+  if (*head == NULL)
+    heap->nonempty[sb->sz_idx] &= ~(1U << sb->bin_idx);
+}
+
+// Push the [next]-linked chain [head]..[tail] of blocks of [sb] onto its
+// thread free list. Once they are on it, the owner may drain them and find
+// [sb] empty; [pushers] keeps it from releasing [sb] while this still looks
+// at it.
+static inline void push_thread_free(superblock_t *sb, void *head, void *tail) {
+  __atomic_fetch_add(&sb->pushers, 1, __ATOMIC_RELAXED);
+  void *old = __atomic_load_n(&sb->thread_free, __ATOMIC_RELAXED);
+  do {
+    *(void **)tail = old;
+  } while (!__atomic_compare_exchange_n(&sb->thread_free, &old, head, true,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+  // Tell the owner only after the push, so that a superblock that changed
+  // hands in the meantime goes to its new owner. The fence pairs with the
+  // one in [bin_insert]: either this sees the superblock in the totally full
+  // bin, or its owner sees the push.
+  if (old == NULL) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    int owner = sb->heap_owner;
+    if (sb->bin_idx == NUM_BINS - 1 && owner >= NUM_NODES)
+      pending_push(&heaps[owner], sb);
   }
-  pthread_spin_unlock(&new_page_lock);
+  __atomic_fetch_sub(&sb->pushers, 1, __ATOMIC_RELEASE);
+}
+
+// Whether [sb], locked and drained, may go back to the free runs: nothing in
+// it is allocated, it is on no [pending] stack, and no remote free is still
+// looking at it.
+static inline bool sb_releasable(superblock_t *sb) {
+  return sb->in_use == 0 && !sb->pending &&
+         __atomic_load_n(&sb->pushers, __ATOMIC_ACQUIRE) == 0;
+}
+
+// Return every block on the thread free list of [sb] to the superblock, and
+// the bytes they held. [sb] and its owning heap must be locked, unless [sb] is
+// on no heap at all. The caller is responsible for the heap's [in_use] and for
+// rebinning [sb].
+static inline u_int32_t drain_thread_free(superblock_t *sb) {
+  if (likely(__atomic_load_n(&sb->thread_free, __ATOMIC_RELAXED) == NULL))
+    return 0;
+
+  void *head = __atomic_exchange_n(&sb->thread_free, NULL, __ATOMIC_ACQ_REL);
+  void *tail = head;
+  int n = 1;
+  bitmap_clear(sb, head);
+  for (; *(void **)tail; tail = *(void **)tail, n++)
+    bitmap_clear(sb, *(void **)tail);
+
+  // Splice the whole list onto the free list.
+  *(void **)tail = sb->free_list;
+  sb->free_list = head;
+  sb->in_use -= n * to_size(sb->sz_idx);
+  return n * to_size(sb->sz_idx);
 }
 
 static void move_superblock(heap_t *old, heap_t *new, superblock_t *sb,
                             int sz_class_idx, int bin) {
-  assert(sb->in_use <= PAGE_SIZE);
+  old->in_use -= drain_thread_free(sb);
+  assert(sb->in_use <= SB_SIZE);
   assert(bin >= 0);
 
-  // We use a special bin to denote totally full blocks.
-  int new_bin = is_superblock_full(sb, sz_class_idx)
-                    ? NUM_BINS - 1
-                    : ((NUM_BINS - 1) * sb->in_use) >> LOG_PAGE_SIZE;
-  if (bin != new_bin || new != NULL) {
-    // Unlink the superblock from the old heap.
-    unlink_superblock(&old->bins[sz_class_idx][bin], sb);
+  assert(bin == sb->bin_idx);
 
-    sb->bin_idx = new_bin;
-    sb->prev = NULL;
-
-    // Link the superblock into the new heap, if any.
-    heap_t *heap = (new != NULL) ? new : old;
-    sb->next = heap->bins[sz_class_idx][new_bin];
-    if (sb->next)
-      sb->next->prev = sb;
-    heap->bins[sz_class_idx][new_bin] = sb;
+  int new_bin = fullness_bin(sb);
+  if (bin != new_bin || new != NULL) {
+    // Unlink the superblock from the old heap, and link it into the new
+    // heap, if any.
+    bin_remove(old, sb);
+    bin_insert(new != NULL ? new : old, sb, new_bin);
   }
 
   // It's possible we were called with [old == new] to move the superblock to
   // the front of its fullness group, in which case we don't have to update any
   // statistics.
   if (old != new &&new != NULL) {
-    old->in_use -= to_size(sb->sz_idx);
-    new->in_use += to_size(sb->sz_idx);
+    old->in_use -= sb->in_use;
+    new->in_use += sb->in_use;
     old->pages_allocated--;
     new->pages_allocated++;
   }
 }
 
 superblock_t *create_new_superblock(heap_t *heap, int sz_class_idx) {
-  superblock_t *sb;
-  pthread_spin_lock(&new_page_lock);
-  if (totally_free_superblocks != NULL) {
-    sb = totally_free_superblocks;
-    totally_free_superblocks = sb->next;
-  } else {
-    sb = mem_sbrk(PAGE_SIZE); // Non-atomic op
-  }
-  pthread_spin_unlock(&new_page_lock);
+  lock_acquire(&new_page_lock);
+  char *mem = alloc_run(1, heap->node, NULL);
+  lock_release(&new_page_lock);
+  superblock_t *sb = mem ? sb_of(mem) : NULL;
 
   if (sb == NULL) {
     fprintf(stderr, "failed to allocate space for superblock\n");
@@ -204,108 +1101,425 @@ superblock_t *create_new_superblock(heap_t *heap, int sz_class_idx) {
   // Link the superblock into the heap.
   sb->heap_owner = heap->heap_idx;
   sb->sz_idx = sz_class_idx;
-  sb->prev = NULL;
-  sb->next = heap->bins[sz_class_idx][0];
-  if (sb->next)
-    sb->next->prev = sb;
-  heap->bins[sz_class_idx][0] = sb;
+  sb->bump = classes[sz_class_idx].offset;
+  bin_insert(heap, sb, 0);
   heap->pages_allocated++;
 
-  pthread_spin_init(&sb->lock, PTHREAD_PROCESS_PRIVATE);
+  lock_init(&sb->lock);
   LOCK(sb);
 
   return sb;
 }
 
-superblock_t *get_superblock_from_global(heap_t *heap, int sz_class_idx) {
-  // Start from [NUM_BINS - 2] to avoid the totally full bin.
-  for (int i = NUM_BINS - 2; i >= 0; i--) {
-    for (superblock_t *sb = heaps->bins[sz_class_idx][i]; sb; sb = sb->next) {
-      if (likely(TRYLOCK(sb) == 0)) {
-        // Is it still not full now?
-        if (!is_superblock_full(sb, sz_class_idx)) {
-          move_superblock(heaps, heap, sb, sz_class_idx, i);
-          sb->heap_owner = heap->heap_idx;
-          sb->bin_idx = i;
-          return sb;
-        }
+// Find a superblock of [heap] that is not full and lock it. [heap] must be
+// locked. Superblocks are taken from the front of the fullest bin that has
+// any, as every bin but the totally full one only holds superblocks with room
+// left, and draining only makes more. Otherwise, a few of the totally full
+// superblocks that got remote frees are drained, so the time spent stays
+// bounded however many superblocks the heap holds.
+static superblock_t *find_superblock(heap_t *heap, int sz_class_idx) {
+  u_int32_t mask = heap->nonempty[sz_class_idx] & ((1U << (NUM_BINS - 1)) - 1);
+  if (mask) {
+    superblock_t *sb = heap->bins[sz_class_idx][log2floor(mask)];
+    // Whoever else locks superblocks of [heap] holds the heap lock too, or
+    // only needs them for an instant.
+    LOCK(sb);
+    heap->in_use -= drain_thread_free(sb);
+    assert(!is_superblock_full(sb, sz_class_idx));
+    return sb;
+  }
 
-        UNLOCK(sb);
-      }
+  for (int i = 0; i < PENDING_SCAN; i++) {
+    superblock_t *sb = pending_pop(heap, sz_class_idx);
+    if (sb == NULL)
+      return NULL;
+
+    LOCK(sb);
+    __atomic_store_n(&sb->pending, 0, __ATOMIC_SEQ_CST);
+    if (sb->heap_owner == heap->heap_idx) {
+      move_superblock(heap, NULL, sb, sz_class_idx, sb->bin_idx);
+      if (!is_superblock_full(sb, sz_class_idx))
+        return sb;
+    } else if (sb->heap_owner >= NUM_NODES && sb->bin_idx == NUM_BINS - 1 &&
+               sb->thread_free) {
+      // It changed hands while queued, and its remote frees since went
+      // unreported; pass it on.
+      pending_push(&heaps[sb->heap_owner], sb);
     }
+    UNLOCK(sb);
   }
+
   return NULL;
 }
 
-superblock_t *get_superblock_from_heap(heap_t *heap, int sz_class_idx) {
+// Take a superblock for [heap], which must be locked, from the global heap of
+// its node, fullest first, and lock it. Superblocks of other nodes are left
+// for their own threads, even if that means carving a new one. Superblocks
+// only reach the global heaps while not full and only get emptier there, so
+// the totally full bin stays empty.
+superblock_t *get_superblock_from_global(heap_t *heap, int sz_class_idx) {
+  sb_stack_t *stacks = sb_stacks[heap->node][sz_class_idx];
   for (int i = NUM_BINS - 2; i >= 0; i--) {
-    for (superblock_t *sb = heap->bins[sz_class_idx][i]; sb; sb = sb->next) {
-      if (likely(TRYLOCK(sb) == 0)) {
-        if (!is_superblock_full(sb, sz_class_idx)) {
-          sb->bin_idx = i;
-          return sb;
-        }
+    superblock_t *sb = stack_pop(&stacks[i]);
+    if (sb == NULL)
+      continue;
 
-        UNLOCK(sb);
-      }
-    }
+    // Claim it before draining it, so that remote frees from now on flag
+    // [heap].
+    LOCK(sb);
+    sb->heap_owner = heap->heap_idx;
+    drain_thread_free(sb);
+    assert(!is_superblock_full(sb, sz_class_idx));
+    bin_insert(heap, sb, fullness_bin(sb));
+    heap->in_use += sb->in_use;
+    heap->pages_allocated++;
+    return sb;
   }
-
   return NULL;
 }
 
+superblock_t *get_superblock_from_heap(heap_t *heap, int sz_class_idx) {
+  return find_superblock(heap, sz_class_idx);
+}
+
 superblock_t *get_superblock_and_lock(heap_t *heap, int sz_class_idx) {
   superblock_t *sb = get_superblock_from_heap(heap, sz_class_idx);
   if (sb)
     return sb;
 
-  LOCK(heaps);
   sb = get_superblock_from_global(heap, sz_class_idx);
-  UNLOCK(heaps);
   if (sb)
     return sb;
 
   return create_new_superblock(heap, sz_class_idx);
 }
 
-void *mm_malloc(size_t sz) {
-  if (sz > PAGE_SIZE / 2) {
-    void *ptr = create_new_hugeblock(sz);
-    return ptr;
+// Take a block from [sb], which must be locked and not full: the most
+// recently freed one if any, otherwise the next never-used one.
+static inline void *alloc_block(superblock_t *sb, int sz_class_idx) {
+  void *ptr = sb->free_list;
+  if (ptr) {
+    sb->free_list = *(void **)ptr;
+  } else {
+    ptr = sb_start(sb) + sb->bump;
+    sb->bump += to_size(sz_class_idx);
+    assert(sb->bump <= SB_SIZE);
   }
 
-  int heap_id = hash();
-  heap_t *heap = &heaps[heap_id];
-  assert(heap->heap_idx == heap_id);
+  bitmap_set(sb, ptr);
+  sb->in_use += to_size(sz_class_idx);
+  return ptr;
+}
 
-  int sz_class_idx = GET_SZ_CLASS(sz);
-  assert(sz_class_idx < SZ_CLASS);
+// Return the [n] blocks of the [next]-linked chain [head]..[tail] to their
+// superblock [sb]. Both the owning heap and [sb] must be locked.
+static inline void free_blocks(heap_t *heap, superblock_t *sb, void *head,
+                               void *tail, u_int32_t n) {
+#ifdef CHECK_BITMAP
+  for (void *ptr = head; ptr != tail; ptr = *(void **)ptr)
+    bitmap_clear(sb, ptr);
+  bitmap_clear(sb, tail);
+#endif
+  *(void **)tail = sb->free_list;
+  sb->free_list = head;
+  sb->in_use -= n * to_size(sb->sz_idx);
+  heap->in_use -= n * to_size(sb->sz_idx);
 
-  LOCK(heap);
-  superblock_t *sb = get_superblock_and_lock(heap, sz_class_idx);
+  // Move the superblock to its appropriate fullness group.
+  move_superblock(heap, heap, sb, sb->sz_idx, sb->bin_idx);
+}
 
-  int idx = next_block(sb, num_blocks(sz_class_idx));
-  assert(idx >= 0);
+// Take [sb], which must be locked and not totally full, off [heap], which
+// must be locked too: a totally empty superblock goes back to the free pool,
+// any other one to the global heap of the node. Unlocks [sb].
+static void evict_superblock(heap_t *heap, superblock_t *sb) {
+  heap->in_use -= drain_thread_free(sb);
+  bin_remove(heap, sb);
+  heap->in_use -= sb->in_use;
+  heap->pages_allocated--;
+  if (sb_releasable(sb)) {
+    UNLOCK(sb);
+    lock_destroy(&sb->lock);
+    lock_acquire(&new_page_lock);
+    free_run(sb_start(sb), 1);
+    lock_release(&new_page_lock);
+  } else {
+    // Transfer the superblock from a thread heap into the global heap.
+    sb->bin_idx = fullness_bin(sb);
+    sb->heap_owner = global_heap(heap)->heap_idx;
+    UNLOCK(sb);
+    stack_push(&sb_stacks[heap->node][sb->sz_idx][sb->bin_idx], sb);
+  }
+}
 
-  sb->bitmap[idx / 8] |= (1 << (idx % 8));
-  sb->in_use += to_size(sz_class_idx);
-  heap->in_use += to_size(sz_class_idx);
+// If [heap] is not a global heap and meets the emptiness threshold,
+// transfer a mostly-empty superblock from it into the global heap of its
+// node, or hand a totally empty one back to the free pool. [heap] must be
+// locked, and no superblock locks may be held.
+static void release_superblock(heap_t *heap) {
+  if (is_global(heap) ||
+      heap->in_use >> SB_SHIFT >= heap->pages_allocated - K ||
+      heap->in_use >= (1 - F) * heap->pages_allocated * SB_SIZE)
+    return;
 
-  move_superblock(heap, NULL, sb, sz_class_idx, sb->bin_idx);
+  // Try moving a superblock. We'll first try to move the first (least
+  // full) entry, but try subsequent ones if we contend on that
+  // superblock's lock.
+  for (int i = 0; i < SZ_CLASS; i++) {
+    superblock_t *s1 = heap->bins[i][0];
+    if (s1 == NULL || TRYLOCK(s1) != 0)
+      continue;
 
-  UNLOCK(sb);
-  UNLOCK(heap);
+    evict_superblock(heap, s1);
+    return;
+  }
+}
 
-  return ((char *)sb) + sizeof(superblock_t) + (idx * to_size(sz_class_idx));
+// Release superblocks of [heap], which must be locked, for as long as it
+// meets the emptiness threshold.
+static void trim_heap(heap_t *heap) {
+  int pages;
+  do {
+    pages = heap->pages_allocated;
+    release_superblock(heap);
+  } while (heap->pages_allocated < pages);
 }
 
-void mm_free(void *ptr) {
-  superblock_t *sb = (superblock_t *)PAGE_ALIGN(ptr);
-  if (is_hugeblock(sb)) {
-    free_hugeblock(sb);
+// Hand every superblock of [heap], which must be locked, that isn't totally
+// full to the global heap or the free pool; for a heap that no thread is
+// left to allocate from.
+static void drain_heap(heap_t *heap) {
+  for (int i = 0; i < SZ_CLASS; i++) {
+    for (int bin = 0; bin < NUM_BINS - 1; bin++) {
+      superblock_t *sb, *next;
+      for (sb = heap->bins[i][bin]; sb; sb = next) {
+        next = sb->next;
+        LOCK(sb);
+        evict_superblock(heap, sb);
+      }
+    }
+  }
+}
+
+static void pcpu_drain(void);
+
+// Empty the per-CPU caches, bring every thread heap back within the emptiness
+// threshold, hand the empty superblocks of the global heaps back to the free
+// runs, then purge every run that has held unpurged superblocks for
+// [decay_ms]. No locks may be held.
+static void purge(u_int32_t now) {
+  lock_acquire(&purge_lock);
+  pcpu_drain();
+
+  // Flushes release at most one superblock each, which can leave a heap
+  // that a thread freed en masse holding far more than it uses.
+  for (int i = NUM_NODES; i < NUM_NODES + NUM_HEAPS; i++) {
+    heap_t *heap = &heaps[i];
+    LOCK(heap);
+    trim_heap(heap);
+    UNLOCK(heap);
+  }
+
+  superblock_t *empty = NULL, *next;
+  for (int n = 0; n < NUM_NODES; n++) {
+    for (int i = 0; i < SZ_CLASS; i++) {
+      for (int bin = 0; bin < NUM_BINS; bin++) {
+        // Taking the whole stack leaves its superblocks to us alone.
+        sb_stack_t *stack = sb_stacks[n][i];
+        for (superblock_t *sb = stack_take(&stack[bin]); sb; sb = next) {
+          next = sb->next;
+          // A heap that popped it off its pending stack may still hold its
+          // lock; leave it be until the next purge.
+          if (TRYLOCK(sb) != 0) {
+            stack_push(&stack[bin], sb);
+            continue;
+          }
+          // Every free to a superblock of a global heap is remote, so drain
+          // and rebin it first. It can only move to a bin already visited.
+          drain_thread_free(sb);
+          if (sb_releasable(sb)) {
+            UNLOCK(sb);
+            lock_destroy(&sb->lock);
+            sb->next = empty;
+            empty = sb;
+          } else {
+            sb->bin_idx = fullness_bin(sb);
+            UNLOCK(sb);
+            stack_push(&stack[sb->bin_idx], sb);
+          }
+        }
+      }
+    }
+  }
+
+  lock_acquire(&new_page_lock);
+  for (; empty; empty = next) {
+    next = empty->next;
+    free_run(sb_start(empty), 1);
+  }
+  for (int bin = 0; bin < RUN_BINS; bin++)
+    for (superblock_t *sb = free_runs[bin]; sb; sb = sb->next)
+      if (sb->freed_at && now - sb->freed_at >= decay_ms)
+        purge_run(sb);
+  lock_release(&new_page_lock);
+  lock_release(&purge_lock);
+}
+
+// Called from slow paths with no locks held; purges once every quarter of the
+// decay interval, from whichever thread gets here first.
+static void purge_tick(void) {
+  if (decay_ms == 0)
+    return;
+  u_int32_t now = decay_clock();
+  u_int32_t last = __atomic_load_n(&purge_last, __ATOMIC_RELAXED);
+  if (now - last < (decay_ms + 3) / 4 ||
+      !__atomic_compare_exchange_n(&purge_last, &last, now, false,
+                                   __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    return;
+  purge(now);
+}
+
+// With HOARD_PURGE_THREAD set, purging also runs from a thread of its own, so
+// memory is returned even while the program stays off the slow paths.
+static void *purge_thread(void *arg) {
+  struct timespec period = {(decay_ms + 3) / 4 / 1000,
+                            (decay_ms + 3) / 4 % 1000 * 1000000};
+  for (;;) {
+    nanosleep(&period, NULL);
+    purge_tick();
+  }
+  return NULL;
+}
+
+// Resident and hugepage-backed bytes of the data segment, from the kernel's
+// per-mapping accounting.
+static void segment_rss(u_int64_t *rss, u_int64_t *huge) {
+  char line[256];
+  bool in_seg = false;
+  u_int64_t lo, hi, kb;
+  *rss = *huge = 0;
+  FILE *f = fopen("/proc/self/smaps", "r");
+  if (f == NULL)
+    return;
+  while (fgets(line, sizeof(line), f)) {
+    if (sscanf(line, "%llx-%llx ", (unsigned long long *)&lo,
+               (unsigned long long *)&hi) == 2)
+      in_seg = lo < (u_int64_t)(dseg_lo + dseg_size) && hi > (u_int64_t)dseg_lo;
+    else if (in_seg &&
+             sscanf(line, "Rss: %llu kB", (unsigned long long *)&kb) == 1)
+      *rss += kb * 1024;
+    else if (in_seg && sscanf(line, "AnonHugePages: %llu kB",
+                              (unsigned long long *)&kb) == 1)
+      *huge += kb * 1024;
+  }
+  fclose(f);
+}
+
+static void print_stats(void) {
+  fprintf(stderr, "hoard: %llu bytes purged, %llu bytes faulted back in\n",
+          (unsigned long long)purged_bytes, (unsigned long long)faulted_bytes);
+  fprintf(stderr, "hoard: %d thread heaps, %llu migrations under contention\n",
+          NUM_HEAPS, (unsigned long long)migrations);
+
+  // Superblocks in use, and how densely they fill the hugepages they touch.
+  u_int64_t used = 0, touched = 0, rss, huge;
+  for (char *hp = (char *)HP_ALIGN(sb_base); hp < sb_top; hp += HP_SIZE) {
+    char *lo = hp < sb_base ? sb_base : hp;
+    char *hi = hp + HP_SIZE > sb_top ? sb_top : hp + HP_SIZE;
+    u_int64_t n = ((hi - lo) >> SB_SHIFT) - hp_free[hp_index(lo)];
+    used += n;
+    touched += n > 0;
+  }
+  segment_rss(&rss, &huge);
+  fprintf(stderr,
+          "hoard: %llu superblocks in use on %llu hugepages (%.0f%% packed), "
+          "%llu of %llu resident bytes in hugepages\n",
+          (unsigned long long)used, (unsigned long long)touched,
+          touched ? 100.0 * used / (touched * SBS_PER_HP) : 0.0,
+          (unsigned long long)huge, (unsigned long long)rss);
+
+  // Where the resident pages of each node's superblocks actually are.
+  int page = mem_pagesize(), count = SB_SIZE / page;
+  void *pages[SB_SIZE / 4096];
+  int status[SB_SIZE / 4096];
+  for (int n = 0; n < NUM_NODES; n++) {
+    u_int64_t sbs = 0, resident = 0, remote = 0;
+    for (int h = 0; h < NUM_NODES + NUM_HEAPS; h++) {
+      if (heaps[h].node != n)
+        continue;
+      for (int i = 0; i < SZ_CLASS; i++) {
+        for (int bin = 0; bin < NUM_BINS; bin++) {
+          superblock_t *head = is_global(&heaps[h])
+                                   ? stack_top(sb_stacks[h][i][bin])
+                                   : heaps[h].bins[i][bin];
+          for (superblock_t *sb = head; sb; sb = sb->next) {
+            sbs++;
+            for (int k = 0; k < count; k++)
+              pages[k] = sb_start(sb) + (u_int64_t)k * page;
+            if (syscall(SYS_move_pages, 0, count, pages, NULL, status, 0))
+              continue;
+            for (int k = 0; k < count; k++) {
+              resident += status[k] >= 0;
+              remote += status[k] >= 0 && status[k] != n;
+            }
+          }
+        }
+      }
+    }
+    fprintf(stderr,
+            "hoard: node %d: %llu superblocks, %llu resident pages, "
+            "%.1f%% remote\n",
+            n, (unsigned long long)sbs, (unsigned long long)resident,
+            resident ? 100.0 * remote / resident : 0.0);
+  }
+}
+
+// Move the calling thread off [from], whose lock it keeps finding taken, to
+// the thread heap of the same node that the fewest threads use.
+static void migrate_heap(heap_t *from) {
+  thread_cache_t *cache = &tls_cache;
+  heap_t *best = NULL;
+  u_int32_t best_load = ~0U;
+  cache->contention = 0;
+  for (int i = NUM_NODES; i < NUM_NODES + NUM_HEAPS; i++) {
+    heap_t *h = &heaps[i];
+    u_int32_t load = h->cpus + __atomic_load_n(&h->bound, __ATOMIC_RELAXED);
+    if (h != from && h->node == from->node && load < best_load) {
+      best = h;
+      best_load = load;
+    }
+  }
+  if (best == NULL)
+    return;
+
+  cache_register();
+  if (cache->heap)
+    __atomic_fetch_sub(&heaps[cache->heap].bound, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&best->bound, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&migrations, 1, __ATOMIC_RELAXED);
+  cache->heap = best->heap_idx;
+}
+
+// Lock the calling thread's own [heap], keeping track of how often it has to
+// wait for it.
+static inline void lock_heap(heap_t *heap) {
+  thread_cache_t *cache = &tls_cache;
+  if (likely(TRYLOCK(heap) == 0)) {
+    cache->contention -= cache->contention > 0;
     return;
   }
+  LOCK(heap);
+  cache->contention += CONTENTION_COST;
+  if (unlikely(cache->contention >= MIGRATE_AFTER))
+    migrate_heap(heap);
+}
 
+// Lock the heap owning [sb] and then [sb] itself. [*held] is a heap the
+// caller already has locked, or NULL; it is kept if it is still the owner and
+// released otherwise, and set to the locked owner. Superblocks of the global
+// heaps are not protected by any heap lock, so if [sb] moved to one, returns
+// false without locking it; the caller must free to it remotely instead.
+static bool lock_owner(superblock_t *sb, heap_t **held) {
   int heap_owner;
 // For lock ordering purposes, we must always grab a heap lock before a
 // superblock lock. However, this means that between when the heap is locked
@@ -314,102 +1528,1009 @@ void mm_free(void *ptr) {
 // perform is invalid.
 retry_lock:
   heap_owner = sb->heap_owner;
-  heap_t *heap = &heaps[heap_owner];
-  LOCK(heap);
+  if (unlikely(heap_owner < NUM_NODES))
+    return false;
+  if (*held != &heaps[heap_owner]) {
+    if (*held) {
+      release_superblock(*held);
+      UNLOCK(*held);
+    }
+    *held = &heaps[heap_owner];
+    lock_heap(*held);
+  }
   LOCK(sb);
   if (unlikely(sb->heap_owner != heap_owner)) {
     // This race happens very infrequently even with 12 cores, but not bailing
     // out here would deadlock. Instead, pay the performance penalty, unlock
     // everything and try again.
     UNLOCK(sb);
-    UNLOCK(heap);
     goto retry_lock;
   }
+  return true;
+}
 
-  u_int64_t location = bitmask_idx(ptr, sb);
-  sb->bitmap[location / 8] &= ~(1 << (location % 8));
-  sb->in_use -= to_size(sb->sz_idx);
-  heap->in_use -= to_size(sb->sz_idx);
+// Blocks of one superblock on their way back to it, linked through their
+// first word.
+typedef struct block_group {
+  superblock_t *sb;
+  void *head;
+  void *tail;
+  u_int32_t count;
+} block_group_t;
+
+static inline void group_add(block_group_t *g, void *ptr) {
+  *(void **)ptr = g->head;
+  g->head = ptr;
+  if (g->tail == NULL)
+    g->tail = ptr;
+  g->count++;
+}
 
-  // Move the superblock to its appropriate fullness group.
-  move_superblock(heap, heap, sb, sb->sz_idx, sb->bin_idx);
+// Return the blocks of [g] to their superblock. If it belongs to another heap
+// than [heap_id], they are pushed onto its thread free list without taking any
+// lock, with a single atomic operation. Otherwise they are freed directly,
+// with the owning heap locked into [*heap], which the caller holds on to for
+// the next group and has to release in the end.
+static void flush_group(block_group_t *g, int heap_id, heap_t **heap) {
+  superblock_t *sb = g->sb;
+  if (sb->heap_owner != heap_id || !lock_owner(sb, heap)) {
+    push_thread_free(sb, g->head, g->tail);
+    return;
+  }
+
+  free_blocks(*heap, sb, g->head, g->tail, g->count);
 
   // Unlock the superblock here, even though we may end up immediately
-  // reacquiring it below, so we don't have lock inversion with the global
-  // heap lock.
+  // reacquiring it in [release_superblock], which only trylocks it.
   UNLOCK(sb);
+}
+
+// Return the blocks on the [next]-linked list [head] to their superblocks,
+// consecutive blocks of one superblock together, see [flush_group].
+static void flush_blocks(void *head) {
+  int heap_id = hash();
+  heap_t *heap = NULL;
+  block_group_t g = {NULL, NULL, NULL, 0};
+
+  while (head) {
+    void *ptr = head;
+    head = *(void **)ptr;
+
+    superblock_t *sb = sb_of(ptr);
+    if (sb != g.sb) {
+      if (g.sb)
+        flush_group(&g, heap_id, &heap);
+      g = (block_group_t){sb, NULL, NULL, 0};
+    }
+    group_add(&g, ptr);
+  }
+
+  if (g.sb)
+    flush_group(&g, heap_id, &heap);
+
+  if (heap) {
+    release_superblock(heap);
+    UNLOCK(heap);
+  }
+}
+
+#ifdef PERCPU_CACHE
+// Start of an rseq critical section: label 0 arms it by pointing the rseq
+// area at its descriptor, label 1 starts it.
+#define RSEQ_ENTER                                                             \
+  "0:\n\t"                                                                     \
+  "leaq 3f(%%rip), %%rax\n\t"                                                  \
+  "movq %%rax, %[rseq_cs]\n\t"                                                 \
+  "1:\n\t"
+
+// Descriptor of the critical section from label 1 to label 2, and its abort
+// handler, which simply starts over. The handler must be preceded by the
+// signature glibc registered.
+#define RSEQ_DESCRIBE                                                          \
+  ".pushsection __rseq_cs, \"aw\"\n\t"                                         \
+  ".balign 32\n\t"                                                            \
+  "3:\n\t"                                                                    \
+  ".long 0, 0\n\t"                                                            \
+  ".quad 1b, 2b - 1b, 4f\n\t"                                                 \
+  ".popsection\n\t"                                                           \
+  ".pushsection __rseq_failure, \"ax\"\n\t"                                   \
+  ".byte 0x0f, 0xb9, 0x3d\n\t"                                                \
+  ".long " __stringify(RSEQ_SIG) "\n\t"                                       \
+  "4:\n\t"                                                                    \
+  "jmp 0b\n\t"                                                                \
+  ".popsection\n\t"
+#define __stringify_1(x) #x
+#define __stringify(x) __stringify_1(x)
+
+static inline struct rseq *rseq_area(void) {
+  return (struct rseq *)((char *)__builtin_thread_pointer() + __rseq_offset);
+}
+
+// Move up to [n] blocks from [objs] into the bin for [sz_class_idx] of the
+// current CPU. Returns how many were moved; 0 when the bin is full or rseq is
+// not registered for this thread, in which case its cpu_id is negative.
+static inline u_int32_t pcpu_push(int sz_class_idx, void **objs, u_int32_t n) {
+  struct rseq *rs = rseq_area();
+  u_int64_t stride = SZ_CLASS * sizeof(pcpu_bin_t), num = n, done;
+  u_int64_t cap = classes[sz_class_idx].pcpu;
+  pcpu_bin_t *bin = &pcpu_base[sz_class_idx];
+  __asm__ __volatile__(RSEQ_ENTER
+                       "movl %[cpu_id], %%eax\n\t"
+                       "cmpl %[cpus], %%eax\n\t"
+                       "jae 6f\n\t"
+                       "cmpb $0, %[stopped]\n\t"
+                       "jne 6f\n\t"
+                       "imulq %[stride], %%rax\n\t"
+                       "addq %[bin], %%rax\n\t"
+                       "movq (%%rax), %%rcx\n\t"
+                       "movq %[cap], %%rdx\n\t"
+                       "subq %%rcx, %%rdx\n\t"
+                       "jbe 6f\n\t"
+                       "cmpq %[n], %%rdx\n\t"
+                       "cmovaq %[n], %%rdx\n\t"
+                       "xorl %%r8d, %%r8d\n\t"
+                       "7:\n\t"
+                       "movq (%[objs], %%r8, 8), %%r9\n\t"
+                       "leaq (%%rcx, %%r8), %%r10\n\t"
+                       "movq %%r9, 8(%%rax, %%r10, 8)\n\t"
+                       "incq %%r8\n\t"
+                       "cmpq %%rdx, %%r8\n\t"
+                       "jb 7b\n\t"
+                       "addq %%rdx, %%rcx\n\t"
+                       "movq %%rcx, (%%rax)\n\t" // Commit
+                       "2:\n\t"
+                       "jmp 5f\n\t"
+                       "6:\n\t"
+                       "xorl %%edx, %%edx\n\t"
+                       "5:\n\t" RSEQ_DESCRIBE
+                       : [done] "=&d"(done)
+                       : [rseq_cs] "m"(rs->rseq_cs), [cpu_id] "m"(rs->cpu_id),
+                         [stopped] "m"(pcpu_stopped), [cpus] "r"(pcpu_cpus),
+                         [stride] "r"(stride), [bin] "r"(bin), [cap] "r"(cap),
+                         [objs] "r"(objs), [n] "r"(num)
+                       : "rax", "rcx", "r8", "r9", "r10", "memory", "cc");
+  return done;
+}
 
-  // If the superblock is not in the global heap already, and meets the
-  // emptiness threshold, transfer a mostly-empty superblock from this
-  // heap into the global heap.
-  if (heap_owner != 0 && heap->in_use < heap->pages_allocated - K &&
-      heap->in_use < (1 - F) * heap->pages_allocated * PAGE_SIZE) {
-    assert(heaps != heap);
-    LOCK(heaps);
-    // Try moving a superblock. We'll first try to move the first (least
-    // full) entry, but try subsequent ones if we contend on that
-    // superblock's lock.
+// Move up to [n] blocks from the bin for [sz_class_idx] of the current CPU
+// into [objs]. Returns how many were moved.
+static inline u_int32_t pcpu_pop(int sz_class_idx, void **objs, u_int32_t n) {
+  struct rseq *rs = rseq_area();
+  u_int64_t stride = SZ_CLASS * sizeof(pcpu_bin_t), num = n, done;
+  pcpu_bin_t *bin = &pcpu_base[sz_class_idx];
+  __asm__ __volatile__(RSEQ_ENTER
+                       "movl %[cpu_id], %%eax\n\t"
+                       "cmpl %[cpus], %%eax\n\t"
+                       "jae 6f\n\t"
+                       "cmpb $0, %[stopped]\n\t"
+                       "jne 6f\n\t"
+                       "imulq %[stride], %%rax\n\t"
+                       "addq %[bin], %%rax\n\t"
+                       "movq (%%rax), %%rcx\n\t"
+                       "testq %%rcx, %%rcx\n\t"
+                       "jz 6f\n\t"
+                       "movq %%rcx, %%rdx\n\t"
+                       "cmpq %[n], %%rdx\n\t"
+                       "cmovaq %[n], %%rdx\n\t"
+                       "subq %%rdx, %%rcx\n\t"
+                       "xorl %%r8d, %%r8d\n\t"
+                       "7:\n\t"
+                       "leaq (%%rcx, %%r8), %%r10\n\t"
+                       "movq 8(%%rax, %%r10, 8), %%r9\n\t"
+                       "movq %%r9, (%[objs], %%r8, 8)\n\t"
+                       "incq %%r8\n\t"
+                       "cmpq %%rdx, %%r8\n\t"
+                       "jb 7b\n\t"
+                       "movq %%rcx, (%%rax)\n\t" // Commit
+                       "2:\n\t"
+                       "jmp 5f\n\t"
+                       "6:\n\t"
+                       "xorl %%edx, %%edx\n\t"
+                       "5:\n\t" RSEQ_DESCRIBE
+                       : [done] "=&d"(done)
+                       : [rseq_cs] "m"(rs->rseq_cs), [cpu_id] "m"(rs->cpu_id),
+                         [stopped] "m"(pcpu_stopped), [cpus] "r"(pcpu_cpus),
+                         [stride] "r"(stride), [bin] "r"(bin), [objs] "r"(objs),
+                         [n] "r"(num)
+                       : "rax", "rcx", "r8", "r9", "r10", "memory", "cc");
+  return done;
+}
+
+// Flush the blocks cached for every CPU back to their heaps; otherwise those
+// of CPUs the program stopped running on would stay there for good. Critical
+// sections bail out while [pcpu_stopped] is set, and the fence restarts any
+// that were under way, so nothing touches the bins until it is cleared. No
+// locks may be held.
+static void pcpu_drain(void) {
+  if (pcpu_base == NULL || !pcpu_fence ||
+      __atomic_exchange_n(&pcpu_stopped, 1, __ATOMIC_ACQUIRE))
+    return;
+  if (syscall(SYS_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED_RSEQ, 0, 0) ==
+      0) {
     for (int i = 0; i < SZ_CLASS; i++) {
-      superblock_t *s1 = heap->bins[i][0];
-      if (s1 == NULL || TRYLOCK(s1) != 0)
-        continue;
+      void *head = NULL;
+      for (u_int32_t cpu = 0; cpu < pcpu_cpus; cpu++) {
+        pcpu_bin_t *bin = &pcpu_base[cpu * SZ_CLASS + i];
+        for (u_int64_t k = 0; k < bin->count; k++) {
+          *(void **)bin->slots[k] = head;
+          head = bin->slots[k];
+        }
+        bin->count = 0;
+      }
+      if (head)
+        flush_blocks(head);
+    }
+  }
+  __atomic_store_n(&pcpu_stopped, 0, __ATOMIC_RELEASE);
+}
+#else
+static inline u_int32_t pcpu_push(int sz_class_idx, void **objs, u_int32_t n) {
+  return 0;
+}
 
-      if (s1->in_use == 0) {
-        unlink_superblock(&heap->bins[i][0], s1);
-        heap->pages_allocated--;
-        UNLOCK(s1);
-        UNLOCK(heaps);
-        UNLOCK(heap);
+static inline u_int32_t pcpu_pop(int sz_class_idx, void **objs, u_int32_t n) {
+  return 0;
+}
+
+static inline void pcpu_drain(void) {}
+#endif
+
+// Stash as many of the [next]-linked blocks [head] of size class
+// [sz_class_idx] as fit in the current CPU's cache. Returns the rest.
+static void *pcpu_stash(int sz_class_idx, void *head) {
+  void *objs[PCPU_SLOTS];
+  u_int32_t n = 0, cap = classes[sz_class_idx].pcpu;
+  if (pcpu_base == NULL || cap == 0)
+    return head;
+
+  for (; head && n < cap; head = *(void **)head)
+    objs[n++] = head;
+  for (u_int32_t pushed = pcpu_push(sz_class_idx, objs, n); n > pushed;) {
+    void *ptr = objs[--n];
+    *(void **)ptr = head;
+    head = ptr;
+  }
+  return head;
+}
+
+// Flush every cached block of the exiting thread back to the heaps, and make
+// any later frees by this thread (from other TLS destructors) bypass the
+// cache. Then give back what its heap holds beyond the emptiness threshold,
+// which the flush alone only does one superblock at a time; and if no CPU and
+// no other thread uses that heap any more, everything that isn't full, so
+// that threads coming and going don't strand memory in heaps nobody
+// allocates from.
+static void cache_destroy(void *arg) {
+  thread_cache_t *cache = arg;
+  heap_t *heap = &heaps[hash()];
+  cache->disabled = true;
+  for (int i = 0; i < SZ_CLASS; i++) {
+    cache_bin_t *bin = &cache->bins[i];
+    void *head = bin->head;
+    bin->head = NULL;
+    bin->count = 0;
+    bin->max = 0;
+    flush_blocks(head);
+  }
+
+  if (cache->num_runs) {
+    lock_acquire(&new_page_lock);
+    for (u_int32_t i = 0; i < cache->num_runs; i++)
+      free_run(sb_start(cache->runs[i]), cache->runs[i]->num_sbs);
+    lock_release(&new_page_lock);
+    cache->num_runs = 0;
+  }
+
+  LOCK(heap);
+  if (cache->heap) {
+    __atomic_fetch_sub(&heap->bound, 1, __ATOMIC_RELAXED);
+    cache->heap = 0;
+  }
+  cache->contention = 0;
+  if (heap->cpus == 0 && __atomic_load_n(&heap->bound, __ATOMIC_RELAXED) == 0)
+    drain_heap(heap);
+  else
+    trim_heap(heap);
+  UNLOCK(heap);
+  purge_tick();
+}
 
-        pthread_spin_destroy(&s1->lock);
-        pthread_spin_lock(&new_page_lock);
-        s1->next = totally_free_superblocks;
-        totally_free_superblocks = s1;
-        pthread_spin_unlock(&new_page_lock);
-        return;
-      } else {
-        // Transfer the superblock from a thread heap into the global heap.
-        move_superblock(heap, heaps, s1, i, 0);
-        s1->heap_owner = 0;
-        UNLOCK(s1);
-        break;
+// Blocks moved per refill or flush of size class [sz_class_idx].
+static inline u_int32_t cache_batch(int sz_class_idx) {
+  return classes[sz_class_idx].batch;
+}
+
+// Upper bound on [cache_bin_t.max] for size class [sz_class_idx].
+static inline u_int32_t cache_limit(int sz_class_idx) {
+  return classes[sz_class_idx].limit;
+}
+
+// Slow path of [mm_malloc]: the thread's cache for [sz_class_idx] is empty,
+// so carve a batch of blocks out of a single superblock of this thread's heap
+// and return one of them.
+static void *cache_refill(cache_bin_t *bin, int sz_class_idx) {
+  cache_register();
+
+  // A cache that keeps running dry deserves to be deeper, up to its limit.
+  u_int32_t batch = cache_batch(sz_class_idx);
+  if (unlikely(tls_cache.disabled)) {
+    batch = 1;
+  } else if (bin->max < cache_limit(sz_class_idx)) {
+    bin->max += batch;
+    if (bin->max > cache_limit(sz_class_idx))
+      bin->max = cache_limit(sz_class_idx);
+  }
+
+  if (pcpu_base && classes[sz_class_idx].pcpu) {
+    void *objs[PCPU_SLOTS];
+    u_int32_t n = pcpu_pop(sz_class_idx, objs,
+                           batch < PCPU_SLOTS ? batch : PCPU_SLOTS);
+    if (n) {
+      for (u_int32_t i = 1; i < n; i++) {
+        *(void **)objs[i] = bin->head;
+        bin->head = objs[i];
       }
+      bin->count += n - 1;
+      return objs[0];
     }
+  }
 
-    UNLOCK(heaps);
+  int heap_id = hash();
+  heap_t *heap = &heaps[heap_id];
+  assert(heap->heap_idx == heap_id);
+
+  lock_heap(heap);
+  superblock_t *sb = get_superblock_and_lock(heap, sz_class_idx);
+
+  void *ret = alloc_block(sb, sz_class_idx);
+  u_int32_t n = 1;
+  for (; n < batch && !is_superblock_full(sb, sz_class_idx); n++) {
+    void *ptr = alloc_block(sb, sz_class_idx);
+    *(void **)ptr = bin->head;
+    bin->head = ptr;
   }
+  bin->count += n - 1;
+  heap->in_use += n * to_size(sz_class_idx);
 
+  move_superblock(heap, NULL, sb, sz_class_idx, sb->bin_idx);
+
+  UNLOCK(sb);
+  UNLOCK(heap);
+  purge_tick();
+
+  return ret;
+}
+
+// Slow path of [mm_free]: the thread's cache for [sz_class_idx] grew past its
+// limit. Keep the most recently freed half and flush the rest.
+static void cache_overflow(cache_bin_t *bin, int sz_class_idx) {
+  u_int32_t keep = bin->max / 2;
+  void *head;
+
+  if (keep == 0) {
+    head = bin->head;
+    bin->head = NULL;
+  } else {
+    void *last = bin->head;
+    for (u_int32_t i = 1; i < keep; i++)
+      last = *(void **)last;
+    head = *(void **)last;
+    *(void **)last = NULL;
+  }
+  bin->count = keep;
+
+  // A thread that keeps overflowing frees more than it allocates of this
+  // size, so caching as much for it only strands memory.
+  u_int32_t batch = cache_batch(sz_class_idx);
+  if (++bin->overflows >= CACHE_MAX_OVERFLOWS && bin->max > batch) {
+    bin->max -= batch;
+    bin->overflows = 0;
+  }
+
+  head = pcpu_stash(sz_class_idx, head);
+  if (head) {
+    flush_blocks(head);
+    purge_tick();
+  }
+}
+
+void *mm_malloc(size_t sz) {
+  if (sz > MAX_SMALL) {
+    void *ptr = create_new_hugeblock(sz, SB_HEADER_SIZE, NULL);
+    return ptr;
+  }
+
+  int sz_class_idx = GET_SZ_CLASS(sz);
+  assert(sz_class_idx < SZ_CLASS);
+
+  cache_bin_t *bin = &tls_cache.bins[sz_class_idx];
+  void *ptr = bin->head;
+  if (unlikely(ptr == NULL))
+    return cache_refill(bin, sz_class_idx);
+
+  bin->head = *(void **)ptr;
+  bin->count--;
+  return ptr;
+}
+
+// Allocate [n] blocks of [sz] bytes into [out], straight from the superblocks
+// of the calling thread's heap once its cache runs dry, all under a single
+// acquisition of the heap lock. Returns the number of blocks allocated, which
+// is only less than [n] when large blocks run out of memory.
+size_t mm_malloc_batch(size_t sz, size_t n, void **out) {
+  if (sz > MAX_SMALL) {
+    for (size_t i = 0; i < n; i++)
+      if ((out[i] = create_new_hugeblock(sz, SB_HEADER_SIZE, NULL)) == NULL)
+        return i;
+    return n;
+  }
+
+  int sz_class_idx = GET_SZ_CLASS(sz);
+  cache_bin_t *bin = &tls_cache.bins[sz_class_idx];
+  size_t i = 0;
+  for (; i < n && bin->head; i++) {
+    out[i] = bin->head;
+    bin->head = *(void **)out[i];
+    bin->count--;
+  }
+  if (i == n)
+    return n;
+
+  heap_t *heap = &heaps[hash()];
+  lock_heap(heap);
+  while (i < n) {
+    superblock_t *sb = get_superblock_and_lock(heap, sz_class_idx);
+    u_int32_t k = 0;
+    for (; i < n && !is_superblock_full(sb, sz_class_idx); i++, k++)
+      out[i] = alloc_block(sb, sz_class_idx);
+    heap->in_use += k * to_size(sz_class_idx);
+
+    move_superblock(heap, NULL, sb, sz_class_idx, sb->bin_idx);
+    UNLOCK(sb);
+  }
   UNLOCK(heap);
+  purge_tick();
+
+  return n;
+}
+
+// Free the [n] blocks [ptrs], bypassing the thread cache. Blocks are grouped
+// by superblock, so that each superblock is locked, counted and rebinned once
+// per group rather than once per block; a superblock that has to make way for
+// another one of the same slot is flushed early.
+void mm_free_batch(void **ptrs, size_t n) {
+  block_group_t groups[FREE_BATCH_GROUPS];
+  int heap_id = hash();
+  heap_t *heap = NULL;
+
+  memset(groups, 0, sizeof(groups));
+  for (size_t i = 0; i < n; i++) {
+    superblock_t *sb = block_sb(ptrs[i]);
+    if (is_hugeblock(sb)) {
+      // Freeing may purge, which takes every heap lock.
+      if (heap) {
+        release_superblock(heap);
+        UNLOCK(heap);
+        heap = NULL;
+      }
+      free_hugeblock(sb);
+      continue;
+    }
+
+    block_group_t *g = &groups[sb_index(sb_start(sb)) % FREE_BATCH_GROUPS];
+    if (g->sb != sb) {
+      if (g->sb)
+        flush_group(g, heap_id, &heap);
+      *g = (block_group_t){sb, NULL, NULL, 0};
+    }
+    group_add(g, ptrs[i]);
+  }
+
+  for (int i = 0; i < FREE_BATCH_GROUPS; i++)
+    if (groups[i].sb)
+      flush_group(&groups[i], heap_id, &heap);
+
+  if (heap) {
+    release_superblock(heap);
+    UNLOCK(heap);
+  }
+  purge_tick();
+}
+
+// Put [ptr], a small block of size class [sz_class_idx], in the thread cache.
+static inline void cache_free(void *ptr, int sz_class_idx) {
+  cache_bin_t *bin = &tls_cache.bins[sz_class_idx];
+  *(void **)ptr = bin->head;
+  bin->head = ptr;
+  if (unlikely(++bin->count > bin->max))
+    cache_overflow(bin, sz_class_idx);
+}
+
+void mm_free(void *ptr) {
+  superblock_t *sb = block_sb(ptr);
+  if (is_hugeblock(sb)) {
+    free_hugeblock(sb);
+    return;
+  }
+
+  // The size class of an allocated block never changes, so it is safe to
+  // read without holding any lock.
+  cache_free(ptr, sb->sz_idx);
+}
+
+// Bytes usable at [ptr]: all of its size class, or for large blocks, all the
+// way to the end of their run of superblocks.
+size_t mm_malloc_usable_size(void *ptr) {
+  superblock_t *sb = block_sb(ptr);
+  if (is_hugeblock(sb))
+    return sb_start(sb) + ((size_t)sb->num_sbs << SB_SHIFT) - (char *)ptr;
+  return to_size(sb->sz_idx);
+}
+
+// [mm_free] for callers that know the size they asked for, or any size up to
+// the usable size they got: the size class follows from it, so small blocks
+// go back to the thread cache without their superblock header being read.
+// Debug builds check the size against the header.
+void mm_free_sized(void *ptr, size_t sz) {
+  superblock_t *sb = block_sb(ptr);
+  if (sz > MAX_SMALL) {
+#ifndef NDEBUG
+    if (!is_hugeblock(sb) || sz > mm_malloc_usable_size(ptr)) {
+      fprintf(stderr, "mm_free_sized: %p is no block of %zu bytes\n", ptr, sz);
+      abort();
+    }
+#endif
+    free_hugeblock(sb);
+    return;
+  }
+
+  int sz_class_idx = GET_SZ_CLASS(sz);
+#ifndef NDEBUG
+  if (is_hugeblock(sb) || sb->sz_idx != sz_class_idx) {
+    fprintf(stderr, "mm_free_sized: %p is no block of %zu bytes\n", ptr, sz);
+    abort();
+  }
+#endif
+  cache_free(ptr, sz_class_idx);
+}
+
+// [mm_malloc] that also stores the usable size of the block in [*usable], so
+// that callers can grow into all of it.
+void *mm_malloc_usable(size_t sz, size_t *usable) {
+  void *ptr = mm_malloc(sz);
+  if (ptr == NULL)
+    *usable = 0;
+  else if (sz > MAX_SMALL)
+    *usable = mm_malloc_usable_size(ptr);
+  else
+    *usable = to_size(GET_SZ_CLASS(sz));
+  return ptr;
+}
+
+// Resize the block at [ptr] to [sz] bytes, keeping its contents up to the
+// smaller of the two. Small blocks stay put while [sz] falls in their size
+// class. Large blocks shrink in place and grow in place into free superblocks
+// right after them; failing that, the big ones move by remapping their pages
+// rather than by copying them.
+void *mm_realloc(void *ptr, size_t sz) {
+  if (ptr == NULL)
+    return mm_malloc(sz);
+
+  superblock_t *sb = block_sb(ptr);
+  if (is_hugeblock(sb)) {
+    if (sz > MAX_SMALL && resize_hugeblock(ptr, sz))
+      return ptr;
+  } else if (sz <= MAX_SMALL && GET_SZ_CLASS(sz) == sb->sz_idx) {
+    return ptr;
+  }
+
+  void *new_ptr = mm_malloc(sz);
+  if (new_ptr == NULL)
+    return NULL;
+  size_t old_sz = mm_malloc_usable_size(ptr);
+  // Remapping keeps offsets into the run, so aligned blocks get copied.
+  if (!is_hugeblock(sb) || ptr != sb_data(sb) || sz <= MAX_SMALL ||
+      sb->num_sbs < REMAP_MIN_SBS || !remap_hugeblock(sb, sb_of(new_ptr)))
+    memcpy(new_ptr, ptr, old_sz < sz ? old_sz : sz);
+  mm_free(ptr);
+  return new_ptr;
+}
+
+// Zero [len] bytes at [ptr]. Large blocks are cleared with non-temporal
+// stores, which neither read their lines in first nor evict the program's
+// working set to hold them.
+static void zero_block(void *ptr, size_t len) {
+#ifdef __SSE2__
+  if (len >= STREAM_MIN) {
+    char *p = ptr, *end = p + len;
+    char *a = (char *)(((uintptr_t)p + 63) & ~(uintptr_t)63);
+    __m128i z = _mm_setzero_si128();
+    memset(p, 0, a - p);
+    for (; a + 64 <= end; a += 64) {
+      _mm_stream_si128((__m128i *)a, z);
+      _mm_stream_si128((__m128i *)(a + 16), z);
+      _mm_stream_si128((__m128i *)(a + 32), z);
+      _mm_stream_si128((__m128i *)(a + 48), z);
+    }
+    _mm_sfence();
+    memset(a, 0, end - a);
+    return;
+  }
+#endif
+  memset(ptr, 0, len);
+}
+
+// [n] zeroed elements of [sz] bytes. Large blocks carved from fresh or purged
+// superblocks read as zero already and are left untouched, so their pages are
+// only faulted in once used.
+void *mm_calloc(size_t n, size_t sz) {
+  size_t total;
+  if (__builtin_mul_overflow(n, sz, &total)) {
+    errno = ENOMEM;
+    return NULL;
+  }
+
+  if (total > MAX_SMALL) {
+    bool zero;
+    void *ptr = create_new_hugeblock(total, SB_HEADER_SIZE, &zero);
+    if (ptr && !zero)
+      zero_block(ptr, total);
+    return ptr;
+  }
+
+  void *ptr = mm_malloc(total);
+  if (ptr)
+    memset(ptr, 0, total);
+  return ptr;
+}
+
+// [sz] bytes aligned to [align], a power of two; NULL with errno set to
+// EINVAL if it isn't one. Alignments up to [CLASS_ALIGN] come from the
+// smallest size class whose blocks all have it, so that those blocks go
+// through the thread cache like any other. Larger ones get a hugeblock that
+// starts at the first boundary past its header, or beyond [MAX_ALIGN], a run
+// carved to fit; large blocks are aligned to at least a page, so that they
+// can take O_DIRECT transfers. Blocks of [sz] <= MAX_SMALL may thus be
+// hugeblocks: free them with [mm_free], or with [mm_free_sized] given their
+// usable size.
+void *mm_memalign(size_t align, size_t sz) {
+  if (align == 0 || (align & (align - 1))) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  if (sz <= MAX_SMALL && align <= CLASS_ALIGN) {
+    for (int i = GET_SZ_CLASS(sz); i < SZ_CLASS; i++)
+      if (to_size(i) % align == 0 && classes[i].offset % align == 0)
+        return mm_malloc(to_size(i));
+  }
+  if (align > MAX_ALIGN)
+    return create_aligned_hugeblock(sz, align);
+
+  if (sz > MAX_SMALL && align < (size_t)mem_pagesize())
+    align = mem_pagesize();
+  size_t off = (SB_HEADER_SIZE + align - 1) & ~(align - 1);
+  return create_new_hugeblock(sz, off, NULL);
+}
+
+// C11 aligned_alloc; [sz] need not be a multiple of [align].
+void *mm_aligned_alloc(size_t align, size_t sz) {
+  return mm_memalign(align, sz);
+}
+
+// Reports failure by its result alone, leaving errno as it was.
+int mm_posix_memalign(void **out, size_t align, size_t sz) {
+  if (align < sizeof(void *) || (align & (align - 1)))
+    return EINVAL;
+  int saved = errno;
+  void *ptr = mm_memalign(align, sz);
+  if (ptr == NULL) {
+    int err = errno;
+    errno = saved;
+    return err;
+  }
+  *out = ptr;
+  return 0;
+}
+
+static void init_size_classes(void) {
+  u_int32_t size = 8;
+  for (int i = 0; i < SZ_CLASS; i++) {
+    size_class_t *c = &classes[i];
+    c->size = size;
+    c->offset = SB_HEADER_SIZE;
+    // A header in front of the blocks costs the classes that divide the
+    // superblock evenly a whole block. Where that is more than a sixteenth
+    // of it, shrink the class so that it keeps them all, to a multiple of
+    // the 128 bytes [class_hi] resolves. Power-of-two classes up to
+    // [CLASS_ALIGN] rather pad the header out to a whole block, so that their
+    // blocks are aligned to their size.
+    u_int32_t fit = SB_SIZE / size;
+    if (!(size & (size - 1)) && size <= CLASS_ALIGN)
+      c->offset = (SB_HEADER_SIZE + size - 1) & ~(size - 1);
+    else if (fit < 16 && (SB_SIZE - SB_HEADER_SIZE) / size < fit)
+      c->size = ((SB_SIZE - SB_HEADER_SIZE) / fit) & ~127U;
+    c->recip = ((1ULL << 32) + c->size - 1) / c->size;
+    c->blocks = (SB_SIZE - c->offset) / c->size;
+    c->batch =
+        CACHE_BATCH_BYTES / c->size < 2 ? 2 : CACHE_BATCH_BYTES / c->size;
+    c->limit = CACHE_MAX_BYTES / c->size > CACHE_MAX_BLOCKS
+                   ? CACHE_MAX_BLOCKS
+                   : CACHE_MAX_BYTES / c->size;
+    c->pcpu =
+        PCPU_BYTES / c->size > PCPU_SLOTS ? PCPU_SLOTS : PCPU_BYTES / c->size;
+    assert(c->blocks > 0);
+
+    size += size < 64 ? 8 : (1U << log2floor(size)) / 4;
+  }
+  assert(classes[SZ_CLASS - 1].size == MAX_SMALL);
+
+  // Point every lookup slot at the smallest class that fits the largest
+  // request mapping to that slot.
+  int idx = 0;
+  for (int i = 0; i < sizeof(class_lo); i++) {
+    while (classes[idx].size < i * 8)
+      idx++;
+    class_lo[i] = idx;
+  }
+  idx = 0;
+  for (int i = 0; i < sizeof(class_hi); i++) {
+    while (classes[idx].size < i * 128)
+      idx++;
+    class_hi[i] = idx;
+  }
+}
+
+// Read the sysfs file [path] into [buf] as a string, without allocating.
+static bool read_sysfs(const char *path, char *buf, size_t size) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return false;
+  ssize_t n = read(fd, buf, size - 1);
+  close(fd);
+  if (n <= 0)
+    return false;
+  buf[n] = '\0';
+  return true;
+}
+
+// Parse the next range of a sysfs list such as "0-3,8,10-11" at [*s] into
+// [*lo, *hi]. Returns false at the end of the list.
+static bool next_range(char **s, int *lo, int *hi) {
+  char *p = *s;
+  if (*p < '0' || *p > '9')
+    return false;
+  *lo = *hi = strtol(p, &p, 10);
+  if (*p == '-')
+    *hi = strtol(p + 1, &p, 10);
+  if (*p == ',')
+    p++;
+  *s = p;
+  return true;
+}
+
+// Find the NUMA nodes and the node of every CPU. Everything stays on node 0
+// on single-node machines, when sysfs has no node information, or with
+// HOARD_NUMA=0.
+static void init_numa(void) {
+  char buf[4096], path[64];
+  int lo, hi, nodes = 0;
+  char *env = getenv("HOARD_NUMA");
+  if ((env && *env == '0') ||
+      !read_sysfs("/sys/devices/system/node/online", buf, sizeof(buf)))
+    return;
+  for (char *p = buf; next_range(&p, &lo, &hi);)
+    nodes = hi + 1;
+  if (nodes <= 1)
+    return;
+  if (nodes > MAX_NODES)
+    nodes = MAX_NODES;
+
+  for (int n = 0; n < nodes; n++) {
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", n);
+    if (!read_sysfs(path, buf, sizeof(buf)))
+      continue;
+    for (char *p = buf; next_range(&p, &lo, &hi);)
+      for (int cpu = lo; cpu <= hi && cpu < MAX_CPUS; cpu++)
+        cpu_node[cpu] = n;
+  }
+  NUM_NODES = nodes;
+}
+
+// Map every CPU to a thread heap, one each by default. HOARD_HEAP_SHARE=smt
+// makes SMT siblings share a heap, and HOARD_HEAP_SHARE=l2 all cores sharing
+// an L2 cache, as listed in sysfs.
+static void init_cpu_heaps(void) {
+  char buf[4096], path[96];
+  int lo, hi;
+  for (int cpu = 0; cpu < MAX_CPUS; cpu++)
+    cpu_heap[cpu] = NUM_NODES + cpu % NUM_HEAPS;
+
+  char *share = getenv("HOARD_HEAP_SHARE");
+  const char *list;
+  if (share && strcmp(share, "smt") == 0)
+    list = "topology/thread_siblings_list";
+  else if (share && strcmp(share, "l2") == 0)
+    list = "cache/index2/shared_cpu_list";
+  else
+    return;
+
+  for (int cpu = 0; cpu < NUM_PROCS && cpu < MAX_CPUS; cpu++) {
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/%s", cpu,
+             list);
+    char *p = buf;
+    if (read_sysfs(path, buf, sizeof(buf)) && next_range(&p, &lo, &hi) &&
+        lo < cpu)
+      cpu_heap[cpu] = cpu_heap[lo];
+  }
+}
+
+// A forked child has no thread but the one that forked, so every lock must be
+// free in it. Hold them all across the fork, in the usual order: [purge_lock],
+// the heaps, then [new_page_lock]. Superblock locks are only taken under the
+// lock of their heap or, by [purge], under [purge_lock], so none is held
+// either, and no [pcpu_drain] is under way. Caches of the threads left behind
+// are lost to the child, and so is the purge thread; [purge_tick] still
+// purges on its slow paths.
+static void fork_prepare(void) {
+  lock_acquire(&purge_lock);
+  for (int i = NUM_NODES; i < NUM_NODES + NUM_HEAPS; i++)
+    LOCK(&heaps[i]);
+  lock_acquire(&new_page_lock);
+}
+
+static void fork_parent(void) {
+  lock_release(&new_page_lock);
+  for (int i = NUM_NODES; i < NUM_NODES + NUM_HEAPS; i++)
+    UNLOCK(&heaps[i]);
+  lock_release(&purge_lock);
+}
+
+static void fork_child(void) {
+  lock_init(&new_page_lock);
+  for (int i = NUM_NODES; i < NUM_NODES + NUM_HEAPS; i++)
+    lock_init(&heaps[i].lock);
+  lock_init(&purge_lock);
+#ifdef PERCPU_CACHE
+  pcpu_stopped = 0;
+#endif
 }
 
 int mm_init(void) {
+  // Callers that initialize lazily, like the C++ operator new, may get here
+  // after the program already did.
+  if (heaps != NULL)
+    return 0;
+
   if (mem_init() == -1) {
     fprintf(stderr, "Failed to initialize memory\n");
     return -1;
   }
 
-  pthread_spin_init(&new_page_lock, PTHREAD_PROCESS_PRIVATE);
+  lock_init(&new_page_lock);
+  lock_init(&purge_lock);
+  pthread_key_create(&cache_key, cache_destroy);
 
   NUM_PROCS = getNumProcessors();
-  PAGE_SIZE = mem_pagesize();
-  LOG_PAGE_SIZE = log2floor(PAGE_SIZE);
-  int num_pages = (NUM_PROCS / (PAGE_SIZE / sizeof(heap_t))) + 1;
-
-  heaps = (heap_t *)mem_sbrk(PAGE_SIZE * num_pages);
+  assert(SB_SIZE % mem_pagesize() == 0);
+  init_size_classes();
+
+  init_numa();
+  char *env = getenv("HOARD_HEAPS");
+  NUM_HEAPS = 2 * NUM_PROCS;
+  if (env) {
+    char *end;
+    NUM_HEAPS = strtol(env, &end, 10);
+    if (*end == 'p' || *end == 'P')
+      NUM_HEAPS *= NUM_PROCS;
+  }
+  if (NUM_HEAPS < 1)
+    NUM_HEAPS = 1;
+  if (NUM_NODES + NUM_HEAPS > 256) // heap_owner is a byte
+    NUM_HEAPS = 256 - NUM_NODES;
+  init_cpu_heaps();
+  int num_heaps = NUM_NODES + NUM_HEAPS;
+  heaps = (heap_t *)mem_sbrk(num_heaps * sizeof(heap_t));
   assert(heaps != NULL);
 
-  for (int i = 0; i <= NUM_PROCS; i++) {
+  // Superblocks are found by masking pointers, so pad the break to a multiple
+  // of [SB_SIZE] once here; it only ever grows by whole superblocks after.
+  u_int64_t brk = (u_int64_t)(heaps + num_heaps);
+  if (SB_ALIGN(brk) != brk && mem_sbrk(SB_SIZE - (brk - SB_ALIGN(brk))) == NULL)
+    return -1;
+  sb_top = (char *)SB_ALIGN(brk + SB_SIZE - 1);
+
+  // Reserve per-superblock state for every superblock the data segment can
+  // hold. The kernel only backs the parts that are actually touched.
+  sb_base = (char *)SB_ALIGN(dseg_lo);
+  size_t num_sbs = ((dseg_lo + dseg_size - sb_base) >> SB_SHIFT) + 1;
+  sb_limit = (char *)SB_ALIGN(dseg_lo + dseg_size);
+  run_tags = mmap(NULL, num_sbs * sizeof(u_int32_t), PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (run_tags == MAP_FAILED)
+    return -1;
+  sb_flags = mmap(NULL, num_sbs, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (sb_flags == MAP_FAILED)
+    return -1;
+  size_t num_hps = (num_sbs + SBS_PER_HP - 1) / SBS_PER_HP + 1;
+  hp_free = mmap(NULL, num_hps * sizeof(u_int16_t), PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (hp_free == MAP_FAILED)
+    return -1;
+  if (NUM_NODES > 1) {
+    hp_node = mmap(NULL, num_hps, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (hp_node == MAP_FAILED)
+      return -1;
+  }
+  sb_stacks = mmap(NULL, NUM_NODES * sizeof(*sb_stacks),
+                   PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (sb_stacks == MAP_FAILED)
+    return -1;
+#ifdef OOB_HEADERS
+  sb_meta = mmap(NULL, num_sbs * sizeof(superblock_t), PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (sb_meta == MAP_FAILED)
+    return -1;
+#endif
+
+  for (int i = 0; i < num_heaps; i++) {
     heap_t *h = &heaps[i];
-    pthread_spin_init(&h->lock, PTHREAD_PROCESS_PRIVATE);
+    lock_init(&h->lock);
     h->heap_idx = i;
+    h->node = i < NUM_NODES
+                  ? i
+                  : cpu_node[(i - NUM_NODES) % NUM_PROCS % MAX_CPUS];
+    h->cpus = 0;
+    h->bound = 0;
     h->in_use = 0;
     h->pages_allocated = 0;
     for (int x = 0; x < SZ_CLASS; x++) {
+      h->nonempty[x] = 0;
+      h->pending[x] = 0;
       for (int y = 0; y < NUM_BINS; y++) {
         h->bins[x][y] = NULL;
       }
     }
   }
+  for (int cpu = 0; cpu < NUM_PROCS && cpu < MAX_CPUS; cpu++)
+    heaps[cpu_heap[cpu]].cpus++;
+
+#ifdef PERCPU_CACHE
+  char *rseq = getenv("HOARD_RSEQ");
+  if (__rseq_size > 0 && !(rseq && *rseq == '0')) {
+    pcpu_cpus = get_nprocs_conf();
+    pcpu_base = mmap(NULL, pcpu_cpus * SZ_CLASS * sizeof(pcpu_bin_t),
+                     PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (pcpu_base == MAP_FAILED)
+      pcpu_base = NULL;
+    pcpu_fence = syscall(SYS_membarrier,
+                         MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED_RSEQ, 0,
+                         0) == 0;
+  }
+#endif
+
+  char *thp = getenv("HOARD_THP");
+  if (thp && *thp == '1')
+    use_thp = madvise(dseg_lo, dseg_size, MADV_HUGEPAGE) == 0;
+
+  char *decay = getenv("HOARD_DECAY_MS");
+  if (decay)
+    decay_ms = strtoul(decay, NULL, 10);
+  purge_last = decay_clock();
+
+  // The heaps work from here on. Calls that may allocate come last: when
+  // Hoard replaces malloc, their allocations come straight back to it.
+  pthread_atfork(fork_prepare, fork_parent, fork_child);
+  if (decay_ms && getenv("HOARD_PURGE_THREAD")) {
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, purge_thread, NULL) == 0)
+      pthread_detach(tid);
+  }
+  if (getenv("HOARD_STATS"))
+    atexit(print_stats);
 
   return 0;
 }
@@ -0,0 +1,163 @@
+#ifndef _HOARD_LOCKS_H_
+#define _HOARD_LOCKS_H_
+
+// The locks protecting heaps, superblocks and the free runs. Pick one kind at
+// build time:
+//
+//   LOCK_FUTEX   (default) Test-and-set lock that spins for a bounded time
+//                with exponential backoff, then parks the thread on a futex.
+//   LOCK_TICKET  FIFO ticket lock: the same bounded spin, proportional to the
+//                thread's place in the queue, then futex parking.
+//   LOCK_SPIN    Plain pthread spinlock, spinning for as long as it takes.
+//
+// e.g. make HOARD_FLAGS="-DLOCK_TICKET". Parking matters when threads
+// outnumber cores or a lock holder gets preempted: spinners would otherwise
+// burn whole timeslices waiting for a thread that cannot run.
+
+#include <limits.h>
+#include <linux/futex.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#if !defined(LOCK_FUTEX) && !defined(LOCK_TICKET) && !defined(LOCK_SPIN)
+#define LOCK_FUTEX 1
+#endif
+
+// Pauses between polls of a contended lock double up to [LOCK_MAX_BACKOFF];
+// a waiter parks after [LOCK_SPIN_ROUNDS] polls.
+#define LOCK_MAX_BACKOFF 64
+#define LOCK_SPIN_ROUNDS 16
+
+static inline void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#else
+  __asm__ __volatile__("" ::: "memory");
+#endif
+}
+
+static inline void backoff(uint32_t *delay) {
+  for (uint32_t i = 0; i < *delay; i++)
+    cpu_relax();
+  if (*delay < LOCK_MAX_BACKOFF)
+    *delay <<= 1;
+}
+
+static inline void futex_wait(uint32_t *addr, uint32_t val) {
+  syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static inline void futex_wake(uint32_t *addr, int n) {
+  syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0);
+}
+
+#if defined(LOCK_SPIN)
+
+typedef pthread_spinlock_t hoard_lock_t;
+
+static inline void lock_init(hoard_lock_t *l) {
+  pthread_spin_init(l, PTHREAD_PROCESS_PRIVATE);
+}
+static inline void lock_destroy(hoard_lock_t *l) { pthread_spin_destroy(l); }
+static inline void lock_acquire(hoard_lock_t *l) { pthread_spin_lock(l); }
+static inline int lock_try(hoard_lock_t *l) { return pthread_spin_trylock(l); }
+static inline void lock_release(hoard_lock_t *l) { pthread_spin_unlock(l); }
+
+#elif defined(LOCK_TICKET)
+
+// Tickets and the turn count both go up in steps of 2. Bit 0 of [serving] is
+// set while some waiter is parked on it, so that unlocking only makes a
+// system call when it has someone to wake.
+typedef struct {
+  uint32_t next;
+  uint32_t serving;
+} hoard_lock_t;
+
+static inline void lock_init(hoard_lock_t *l) { l->next = l->serving = 0; }
+static inline void lock_destroy(hoard_lock_t *l) {}
+
+static inline void lock_acquire(hoard_lock_t *l) {
+  uint32_t ticket = __atomic_fetch_add(&l->next, 2, __ATOMIC_RELAXED);
+  uint32_t rounds = 0;
+  for (;;) {
+    uint32_t serving = __atomic_load_n(&l->serving, __ATOMIC_ACQUIRE);
+    if ((serving & ~1U) == ticket)
+      return;
+    if (rounds++ < LOCK_SPIN_ROUNDS) {
+      // Waiters further back in the queue have longer to wait.
+      uint32_t delay = ((ticket - serving) >> 1) * 8;
+      if (delay > LOCK_MAX_BACKOFF * 8)
+        delay = LOCK_MAX_BACKOFF * 8;
+      for (uint32_t i = 0; i < delay; i++)
+        cpu_relax();
+      continue;
+    }
+    if ((serving & 1) ||
+        __atomic_compare_exchange_n(&l->serving, &serving, serving | 1, false,
+                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+      futex_wait(&l->serving, serving | 1);
+  }
+}
+
+static inline int lock_try(hoard_lock_t *l) {
+  uint32_t serving = __atomic_load_n(&l->serving, __ATOMIC_RELAXED) & ~1U;
+  uint32_t ticket = serving;
+  // Only take a ticket if it would be served right away.
+  return __atomic_compare_exchange_n(&l->next, &ticket, serving + 2, false,
+                                     __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)
+             ? 0
+             : 1;
+}
+
+static inline void lock_release(hoard_lock_t *l) {
+  uint32_t old = __atomic_fetch_add(&l->serving, 2, __ATOMIC_RELEASE);
+  if (old & 1) {
+    // Parked waiters can't tell whose turn it is, so wake them all.
+    __atomic_fetch_and(&l->serving, ~1U, __ATOMIC_RELAXED);
+    futex_wake(&l->serving, INT_MAX);
+  }
+}
+
+#else // LOCK_FUTEX
+
+// 0 when free, 1 when held, 2 when held and some waiter may be parked.
+typedef uint32_t hoard_lock_t;
+
+static inline void lock_init(hoard_lock_t *l) { *l = 0; }
+static inline void lock_destroy(hoard_lock_t *l) {}
+
+static inline int lock_try(hoard_lock_t *l) {
+  uint32_t free = 0;
+  return __atomic_compare_exchange_n(l, &free, 1, false, __ATOMIC_ACQUIRE,
+                                     __ATOMIC_RELAXED)
+             ? 0
+             : 1;
+}
+
+static inline void lock_acquire(hoard_lock_t *l) {
+  if (__builtin_expect(lock_try(l) == 0, 1))
+    return;
+
+  uint32_t delay = 1;
+  for (int i = 0; i < LOCK_SPIN_ROUNDS; i++) {
+    backoff(&delay);
+    if (__atomic_load_n(l, __ATOMIC_RELAXED) == 0 && lock_try(l) == 0)
+      return;
+  }
+
+  // Park. Taking the lock as 2 keeps its next holder waking the others.
+  while (__atomic_exchange_n(l, 2, __ATOMIC_ACQUIRE) != 0)
+    futex_wait(l, 2);
+}
+
+static inline void lock_release(hoard_lock_t *l) {
+  if (__atomic_exchange_n(l, 0, __ATOMIC_RELEASE) == 2)
+    futex_wake(l, 1);
+}
+
+#endif
+
+#endif /* _HOARD_LOCKS_H_ */
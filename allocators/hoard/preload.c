@@ -0,0 +1,165 @@
+#define _GNU_SOURCE
+#include "malloc.h"
+#include "memlib.h"
+#include <errno.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+// The C allocation API on top of Hoard, for libhoard.so: run any program on
+// it with LD_PRELOAD=libhoard.so, no relinking and no [mm_init] needed.
+//
+// The first call initializes the allocator; threads racing it wait until it is
+// done. [mm_init] only calls out to code that may allocate once the heaps are
+// set up, and those nested allocations are served right away. Pointers that
+// don't lie in the data segment were never ours, e.g. from the dynamic
+// loader's own allocator before us: they are never freed, and reallocating
+// one copies it into a new block.
+//
+// Failures leave errno as Hoard set it. The library is built with hidden
+// visibility, so only the functions marked [PUBLIC] here interpose on the C
+// library's; Hoard's own symbols stay internal.
+
+#define unlikely(expr) __builtin_expect(!!(expr), 0)
+#define PUBLIC __attribute__((visibility("default")))
+
+static int init_state; // 0 before, 1 during, 2 after [mm_init]
+static __thread bool in_init;
+
+static void __attribute__((noinline)) init_slow(void) {
+  int state = 0;
+  if (__atomic_compare_exchange_n(&init_state, &state, 1, false,
+                                  __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+    in_init = true;
+    if (mm_init() != 0) {
+      static const char msg[] = "libhoard: failed to initialize\n";
+      write(STDERR_FILENO, msg, sizeof(msg) - 1);
+      abort();
+    }
+    in_init = false;
+    __atomic_store_n(&init_state, 2, __ATOMIC_RELEASE);
+    return;
+  }
+  while (__atomic_load_n(&init_state, __ATOMIC_ACQUIRE) != 2)
+    sched_yield();
+}
+
+static inline void init(void) {
+  if (unlikely(__atomic_load_n(&init_state, __ATOMIC_ACQUIRE) != 2) &&
+      !in_init)
+    init_slow();
+}
+
+static inline bool is_ours(void *ptr) {
+  return (uintptr_t)ptr - (uintptr_t)dseg_lo < (uintptr_t)dseg_size;
+}
+
+// The x86-64 ABI promises 16-byte alignment, which Hoard's classes of 24, 40
+// and 56 bytes don't give; every other block is aligned to it, or is smaller.
+static inline size_t abi_size(size_t size) {
+  return size > 8 && size < 64 ? (size + 15) & ~(size_t)15 : size;
+}
+
+static inline void *no_memory(void) {
+  errno = ENOMEM;
+  return NULL;
+}
+
+// Copy up to [n] bytes of the foreign block at [src], whose size we don't
+// know, to [dst]: as far as memory can be read. The page [src] lies on is
+// readable, the block being live; past it, process_vm_readv on ourselves
+// stops at the first page that isn't, where memcpy would fault.
+static void copy_foreign(char *dst, const char *src, size_t n) {
+  size_t page = getpagesize();
+  size_t done = page - ((uintptr_t)src & (page - 1));
+  memcpy(dst, src, done < n ? done : n);
+  while (done < n) {
+    size_t len = n - done < page ? n - done : page;
+    struct iovec local = {dst + done, len};
+    struct iovec remote = {(char *)src + done, len};
+    if (process_vm_readv(getpid(), &local, 1, &remote, 1, 0) != (ssize_t)len)
+      break;
+    done += len;
+  }
+}
+
+PUBLIC void *malloc(size_t size) {
+  init();
+  return mm_malloc(abi_size(size));
+}
+
+PUBLIC void free(void *ptr) {
+  if (is_ours(ptr))
+    mm_free(ptr);
+}
+
+PUBLIC void *calloc(size_t nmemb, size_t size) {
+  size_t total;
+  init();
+  if (__builtin_mul_overflow(nmemb, size, &total))
+    return no_memory();
+  return mm_calloc(1, abi_size(total));
+}
+
+PUBLIC void *realloc(void *ptr, size_t size) {
+  init();
+  if (ptr == NULL)
+    return mm_malloc(abi_size(size));
+  if (size == 0) {
+    free(ptr);
+    return NULL;
+  }
+  if (!is_ours(ptr)) {
+    void *new_ptr = mm_malloc(abi_size(size));
+    if (new_ptr)
+      copy_foreign(new_ptr, ptr, size);
+    return new_ptr;
+  }
+  return mm_realloc(ptr, abi_size(size));
+}
+
+PUBLIC void *reallocarray(void *ptr, size_t nmemb, size_t size) {
+  size_t total;
+  if (__builtin_mul_overflow(nmemb, size, &total))
+    return no_memory();
+  return realloc(ptr, total);
+}
+
+// Like glibc, round alignments up to a power of two; one that overflows
+// becomes 0 and fails.
+PUBLIC void *memalign(size_t alignment, size_t size) {
+  init();
+  if (alignment == 0)
+    alignment = 1;
+  while (alignment & (alignment - 1))
+    alignment += alignment & -alignment;
+  return mm_memalign(alignment, size);
+}
+
+PUBLIC void *aligned_alloc(size_t alignment, size_t size) {
+  init();
+  return mm_aligned_alloc(alignment, size);
+}
+
+PUBLIC int posix_memalign(void **memptr, size_t alignment, size_t size) {
+  init();
+  return mm_posix_memalign(memptr, alignment, size);
+}
+
+// Left to glibc, these would allocate from its own heap.
+PUBLIC void *valloc(size_t size) {
+  return memalign(getpagesize(), size);
+}
+
+PUBLIC void *pvalloc(size_t size) {
+  size_t page = getpagesize();
+  return memalign(page, (size + page - 1) & ~(page - 1));
+}
+
+PUBLIC size_t malloc_usable_size(void *ptr) {
+  return is_ours(ptr) ? mm_malloc_usable_size(ptr) : 0;
+}
@@ -1,9 +1,12 @@
 #include <sys/types.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <strings.h>
 #include <unistd.h>
 #include <assert.h>
+#include <errno.h>
+#include <limits.h>
 #include <pthread.h>
 
 #include "memlib.h"
@@ -383,30 +386,24 @@ subpage_kmalloc(size_t sz)
 	goto doalloc;
 }
 
+/*
+ * Nasty search to find the page that a block came from. Returns NULL
+ * if it's not on any of our pages.
+ */
 static
-int
-subpage_kfree(void *ptr)
+struct pageref *
+subpage_find(vaddr_t ptraddr)
 {
-	int blktype;		// index into sizes[] that we're using
-	vaddr_t ptraddr;	// same as ptr
-	struct pageref *pr=NULL;// pageref for page we're freeing in
-	vaddr_t prpage;		// PR_PAGEADDR(pr)
-	vaddr_t offset;		// offset into page
+	struct pageref *pr=NULL;
+	vaddr_t prpage;
 	int i;
 
-	ptraddr = (vaddr_t)ptr;
-
-	checksubpages();
-
-	/* Nasty search to find the page that this block came from */
-
 	for (i=0; i < NSIZES && pr==NULL; i++) {
 		for (pr = sizebases[i]; pr; pr = pr->next) {
 			prpage = PR_PAGEADDR(pr);
-			blktype = PR_BLOCKTYPE(pr);
 
 			/* check for corruption */
-			assert(blktype>=0 && blktype<NSIZES);
+			assert(PR_BLOCKTYPE(pr)>=0 && PR_BLOCKTYPE(pr)<NSIZES);
 			checksubpage(pr);
 
 			if (ptraddr >= prpage && ptraddr < prpage + PAGE_SIZE) {
@@ -415,11 +412,31 @@ subpage_kfree(void *ptr)
 		}
 	}
 
+	return pr;
+}
+
+static
+int
+subpage_kfree(void *ptr)
+{
+	int blktype;		// index into sizes[] that we're using
+	vaddr_t ptraddr;	// same as ptr
+	struct pageref *pr;	// pageref for page we're freeing in
+	vaddr_t prpage;		// PR_PAGEADDR(pr)
+	vaddr_t offset;		// offset into page
+
+	ptraddr = (vaddr_t)ptr;
+
+	checksubpages();
+
+	pr = subpage_find(ptraddr);
 	if (pr==NULL) {
 		/* Not on any of our pages - not a subpage allocation */
 		return -1;
 	}
 
+	prpage = PR_PAGEADDR(pr);
+	blktype = PR_BLOCKTYPE(pr);
 	offset = ptraddr - prpage;
 
 	/* Check for proper positioning and alignment */
@@ -508,6 +525,40 @@ static void *big_kmalloc(int sz)
 	return result;
 }
 
+/*
+ * The header in front of a big block: its page count, or for a block
+ * that mm_memalign placed further into its chunk, minus the distance
+ * back to the chunk's real header.
+ */
+static int *big_header(void *ptr)
+{
+	int *hdr_ptr = (int *)((char *)ptr - SMALLEST_SUBPAGE_SIZE);
+
+	if (*hdr_ptr < 0) {
+		hdr_ptr = (int *)((char *)hdr_ptr + *hdr_ptr);
+	}
+	return hdr_ptr;
+}
+
+/*
+ * A big block of sz bytes aligned to align: one big enough to hold
+ * such a block anywhere in it, with an offset header just in front.
+ */
+static void *big_kmemalign(size_t align, size_t sz)
+{
+	char *chunk, *result;
+
+	chunk = big_kmalloc(sz + align + SMALLEST_SUBPAGE_SIZE);
+	if (chunk == NULL) {
+		return NULL;
+	}
+	result = (char *)(((vaddr_t)chunk + SMALLEST_SUBPAGE_SIZE +
+			   align - 1) & ~(vaddr_t)(align - 1));
+	*(int *)(result - SMALLEST_SUBPAGE_SIZE) =
+		-(int)(result - chunk);
+	return result;
+}
+
 static void big_kfree(void *ptr)
 {
 	/* Coalescing is unlikely to do much good (other page allocations
@@ -515,7 +566,7 @@ static void big_kfree(void *ptr)
 	 * together), so we don't bother trying.
 	 */
 
-	int *hdr_ptr = (int *)((char *)ptr - SMALLEST_SUBPAGE_SIZE);
+	int *hdr_ptr = big_header(ptr);
 	//int npages = *hdr_ptr;
 
 	struct big_freelist *newfree = (struct big_freelist *) hdr_ptr;
@@ -572,3 +623,179 @@ mm_free(void *ptr)
 	}
 }
 
+/*
+ * Blocks that are big enough already are kept; anything else is copied
+ * to a new one.
+ */
+void *
+mm_realloc(void *ptr, size_t sz)
+{
+	void *result;
+	size_t oldsz;
+
+	if (ptr == NULL) {
+		return mm_malloc(sz);
+	}
+	oldsz = mm_malloc_usable_size(ptr);
+	if (sz <= oldsz) {
+		return ptr;
+	}
+
+	result = mm_malloc(sz);
+	if (result != NULL) {
+		memcpy(result, ptr, oldsz);
+		mm_free(ptr);
+	}
+	return result;
+}
+
+void *
+mm_calloc(size_t n, size_t sz)
+{
+	void *result;
+
+	if (sz != 0 && n > (size_t)-1 / sz) {
+		return NULL;
+	}
+	result = mm_malloc(n * sz);
+	if (result != NULL) {
+		memset(result, 0, n * sz);
+	}
+	return result;
+}
+
+/*
+ * Subpage blocks are aligned to their size, so alignments up to the
+ * largest subpage size come from rounding the size up. Big blocks are
+ * only aligned to SMALLEST_SUBPAGE_SIZE, so larger ones are carved out
+ * of a big block with room to spare. Sets errno to EINVAL if align is
+ * not a power of two, and to ENOMEM when out of memory, or when the
+ * block would not fit the page count of a big block.
+ */
+void *
+mm_memalign(size_t align, size_t sz)
+{
+	void *result;
+
+	if (align == 0 || (align & (align - 1)) != 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+	if (align <= SMALLEST_SUBPAGE_SIZE) {
+		result = mm_malloc(sz);
+	} else {
+		if (sz < align) {
+			sz = align;
+		}
+		if (sz < LARGEST_SUBPAGE_SIZE) {
+			result = mm_malloc(sz);
+		} else if (align > INT_MAX / 4 || sz > INT_MAX / 2 - align) {
+			result = NULL;
+		} else {
+			pthread_mutex_lock(&malloc_lock);
+			result = big_kmemalign(align, sz);
+			pthread_mutex_unlock(&malloc_lock);
+		}
+	}
+	if (result == NULL) {
+		errno = ENOMEM;
+	}
+	return result;
+}
+
+void *
+mm_aligned_alloc(size_t align, size_t sz)
+{
+	return mm_memalign(align, sz);
+}
+
+int
+mm_posix_memalign(void **out, size_t align, size_t sz)
+{
+	void *result;
+
+	if (align < sizeof(void *) || (align & (align - 1)) != 0) {
+		return EINVAL;
+	}
+	result = mm_memalign(align, sz);
+	if (result == NULL) {
+		return ENOMEM;
+	}
+	*out = result;
+	return 0;
+}
+
+/*
+ * Batch versions, taking the lock once for the whole batch.
+ */
+size_t
+mm_malloc_batch(size_t sz, size_t n, void **out)
+{
+	size_t i;
+
+	pthread_mutex_lock(&malloc_lock);
+	for (i = 0; i < n; i++) {
+		if (sz>=LARGEST_SUBPAGE_SIZE) {
+			out[i] = big_kmalloc(sz);
+		} else {
+			out[i] = subpage_kmalloc(sz);
+		}
+		if (out[i] == NULL) {
+			break;
+		}
+	}
+	pthread_mutex_unlock(&malloc_lock);
+
+	return i;
+}
+
+void
+mm_free_batch(void **ptrs, size_t n)
+{
+	size_t i;
+
+	pthread_mutex_lock(&malloc_lock);
+	for (i = 0; i < n; i++) {
+		if (ptrs[i] != NULL && subpage_kfree(ptrs[i])) {
+			big_kfree(ptrs[i]);
+		}
+	}
+	pthread_mutex_unlock(&malloc_lock);
+}
+
+void
+mm_free_sized(void *ptr, size_t sz)
+{
+	(void)sz;
+	mm_free(ptr);
+}
+
+size_t
+mm_malloc_usable_size(void *ptr)
+{
+	struct pageref *pr;
+	size_t result;
+
+	pthread_mutex_lock(&malloc_lock);
+	pr = subpage_find((vaddr_t)ptr);
+	if (pr != NULL) {
+		result = sizes[PR_BLOCKTYPE(pr)];
+	} else {
+		/* Big allocations keep their page count just in front. */
+		int *hdr_ptr = big_header(ptr);
+		result = (char *)hdr_ptr + *hdr_ptr * PAGE_SIZE - (char *)ptr;
+	}
+	pthread_mutex_unlock(&malloc_lock);
+
+	return result;
+}
+
+void *
+mm_malloc_usable(size_t sz, size_t *usable)
+{
+	void *result = mm_malloc(sz);
+
+	*usable = result ? mm_malloc_usable_size(result) : 0;
+	return result;
+}
+
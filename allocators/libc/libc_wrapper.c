@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include "memlib.h"
 
@@ -11,6 +12,69 @@ void mm_free(void *ptr)
   free(ptr);
 }
 
+void *mm_realloc(void *ptr, size_t sz)
+{
+  return realloc(ptr, sz);
+}
+
+void *mm_calloc(size_t n, size_t sz)
+{
+  return calloc(n, sz);
+}
+
+/* From glibc's <malloc.h>, which include/malloc.h shadows. */
+extern void *memalign(size_t align, size_t sz);
+
+void *mm_memalign(size_t align, size_t sz)
+{
+  return memalign(align, sz);
+}
+
+void *mm_aligned_alloc(size_t align, size_t sz)
+{
+  return aligned_alloc(align, sz);
+}
+
+int mm_posix_memalign(void **out, size_t align, size_t sz)
+{
+  return posix_memalign(out, align, sz);
+}
+
+size_t mm_malloc_batch(size_t sz, size_t n, void **out)
+{
+  for (size_t i = 0; i < n; i++)
+    if ((out[i] = malloc(sz)) == NULL)
+      return i;
+  return n;
+}
+
+void mm_free_batch(void **ptrs, size_t n)
+{
+  for (size_t i = 0; i < n; i++)
+    free(ptrs[i]);
+}
+
+void mm_free_sized(void *ptr, size_t sz)
+{
+  (void)sz;
+  free(ptr);
+}
+
+/* From glibc's <malloc.h>, which include/malloc.h shadows. */
+extern size_t malloc_usable_size(void *ptr);
+
+size_t mm_malloc_usable_size(void *ptr)
+{
+  return malloc_usable_size(ptr);
+}
+
+void *mm_malloc_usable(size_t sz, size_t *usable)
+{
+  void *ptr = malloc(sz);
+  *usable = ptr ? malloc_usable_size(ptr) : 0;
+  return ptr;
+}
+
 
 int mm_init(void)
 {
@@ -92,10 +92,9 @@ void* allocate(void* arg)
 					list[p] = 0;
 					size[p] = 0;
 				}
-#if 0 /* We are not implementing realloc for the assignment */
 				else if(RANDOM()%4 == 0 ) /* survived free, check realloc */
 				{	sz = size[p] > Maxsize ? size[p]/4 : 2*size[p];
-					if(!(list[p] = realloc(list[p], sz)) )
+					if(!(list[p] = mm_realloc(list[p], sz)) )
 						error("realloc failed\n");
 					else
 					{	size[p] = sz;
@@ -103,7 +102,6 @@ void* allocate(void* arg)
 							list[p][c*sz/10] = 'r';
 					}
 				}
-#endif /* not implementing realloc */
 			}
 		}
 	}
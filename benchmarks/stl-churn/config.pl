@@ -0,0 +1,4 @@
+# per-benchmark configuration values
+maxtime => '60', # kheap needs ~25s with 1 thread
+args => '10 50000 32 0', # iterations, keys, keylen, pmr
+graphtitle => "stl-churn - runtimes"
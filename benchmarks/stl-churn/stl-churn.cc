@@ -0,0 +1,154 @@
+/**
+ * @file stl-churn.cc
+ *
+ * Threads that each fill a std::map of std::string keys and values, erase
+ * half of it, refill it and clear it again, over and over: the node-sized
+ * and string-sized allocations typical of C++ programs. Everything goes
+ * through the global operator new, or with pmr set, through std::pmr
+ * containers on mm::resource().
+ *
+ * usage: stl-churn-X <threads> <iterations> <keys> <keylen> <pmr>
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <map>
+#include <memory_resource>
+#include <string>
+
+#define MM_GLOBAL_NEW
+#include "mm_alloc.h"
+
+extern "C" {
+#include "memlib.h"
+#include "mm_thread.h"
+#include "timer.h"
+}
+
+int nthreads = 1;	// Default number of threads.
+int niterations = 50;	// Default number of iterations.
+int nkeys = 100000;	// Default number of keys, split among the threads.
+int keylen = 32;	// Default key length, past the inline string buffer.
+int pmr = 0;		// Use std::pmr containers on mm::resource().
+
+// Fill [s] with [keylen] letters from the generator state [seed].
+template <class String> static void make_key (String &s, unsigned int *seed)
+{
+  s.resize(keylen);
+  for (int i = 0; i < keylen; i++) {
+    *seed = *seed * 1103515245 + 12345;
+    s[i] = 'a' + (*seed >> 16) % 26;
+  }
+}
+
+template <class Map> static void churn (Map &m, unsigned int seed)
+{
+  typename Map::key_type key(m.get_allocator());
+  int n = nkeys / nthreads;
+
+  for (int j = 0; j < niterations; j++) {
+    unsigned int s = seed + j;
+    for (int i = 0; i < n; i++) {
+      make_key(key, &s);
+      m.emplace(key, typename Map::mapped_type(key.rbegin(), key.rend(),
+					       m.get_allocator()));
+    }
+
+    // Replay the same keys and erase every other one.
+    s = seed + j;
+    for (int i = 0; i < n; i++) {
+      make_key(key, &s);
+      if (i % 2 == 0)
+	m.erase(key);
+    }
+
+    for (int i = 0; i < n / 2; i++) {
+      make_key(key, &s);
+      m[key].append(key);
+    }
+    m.clear();
+  }
+}
+
+extern void * worker (void *arg)
+{
+  int cpu = (int)(u_int64_t)arg;
+
+  setCPU(cpu);
+
+  if (pmr) {
+    std::pmr::map<std::pmr::string, std::pmr::string> m(mm::resource());
+    churn(m, cpu * 7919);
+  } else {
+    std::map<std::string, std::string> m;
+    churn(m, cpu * 7919);
+  }
+
+  return NULL;
+}
+
+
+int main (int argc, char * argv[])
+{
+	struct timespec start_time;
+	struct timespec end_time;
+	int i;
+
+	if (argc >= 2) {
+		nthreads = atoi(argv[1]);
+	}
+
+	if (argc >= 3) {
+		niterations = atoi(argv[2]);
+	}
+
+	if (argc >= 4) {
+		nkeys = atoi(argv[3]);
+	}
+
+	if (argc >= 5) {
+		keylen = atoi(argv[4]);
+	}
+
+	if (argc >= 6) {
+		pmr = atoi(argv[5]);
+	}
+
+	/* Call allocator-specific initialization function */
+	mm_init();
+
+	pthread_t *threads = new pthread_t[nthreads];
+	int numCPU = getNumProcessors();
+
+	pthread_attr_t attr;
+	initialize_pthread_attr(PTHREAD_CREATE_JOINABLE, SCHED_RR, -10,
+				PTHREAD_EXPLICIT_SCHED, PTHREAD_SCOPE_SYSTEM, &attr);
+
+	printf ("Running stl-churn for %d threads, %d iterations, %d keys, %d key length and %s containers...\n", nthreads, niterations, nkeys, keylen, pmr ? "pmr" : "std");
+
+	/* Get the starting time */
+	clock_gettime(CLOCK_MONOTONIC_RAW, &start_time);
+
+	for (i = 0; i < nthreads; i++) {
+		pthread_create(&threads[i], &attr, &worker, (void *)((u_int64_t)(i+1)%numCPU));
+	}
+
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	/* Get the finish time */
+	clock_gettime(CLOCK_MONOTONIC_RAW, &end_time);
+
+	double t = timespec_diff(&start_time, &end_time);
+
+	printf ("Time elapsed = %f seconds\n", t);
+	printf ("Memory used = %ld bytes\n",mem_usage());
+
+	delete[] threads;
+
+	return 0;
+}
@@ -45,6 +45,7 @@ int nobjects = 30000;   // Default number of objects.
 int nthreads = 1;	// Default number of threads.
 int work = 0;		// Default number of loop iterations.
 int size = 1;
+int batch = 0;		// Objects per mm_malloc_batch/mm_free_batch call, 0 for none.
 
 struct Foo {
   int x;
@@ -69,7 +70,12 @@ extern void * worker (void *arg)
 
     //printf ("a %d\n", j);
     for (i = 0; i < (nobjects / nthreads); i ++) {
-      a[i] = (struct Foo *)mm_malloc(size*sizeof(struct Foo));
+      if (batch > 0 && i % batch == 0) {
+	int n = (nobjects / nthreads) - i < batch ? (nobjects / nthreads) - i : batch;
+	mm_malloc_batch(size*sizeof(struct Foo), n, (void **)&a[i]);
+      } else if (batch <= 0) {
+	a[i] = (struct Foo *)mm_malloc(size*sizeof(struct Foo));
+      }
       for (d = 0; d < work; d++) {
 	volatile int f = 1;
 	f = f + f;
@@ -82,7 +88,12 @@ extern void * worker (void *arg)
     
     //printf ("f %d\n", j);
     for (i = 0; i < (nobjects / nthreads); i ++) {
-      mm_free(a[i]);
+      if (batch > 0 && i % batch == 0) {
+	int n = (nobjects / nthreads) - i < batch ? (nobjects / nthreads) - i : batch;
+	mm_free_batch((void **)&a[i], n);
+      } else if (batch <= 0) {
+	mm_free(a[i]);
+      }
       for (d = 0; d < work; d++) {
 	volatile int f = 1;
 	f = f + f;
@@ -125,6 +136,10 @@ int main (int argc, char * argv[])
 		size = atoi(argv[5]);
 	}
 
+	if (argc >= 7) {
+		batch = atoi(argv[6]);
+	}
+
 
 	/* Call allocator-specific initialization function */
 	mm_init();
@@ -136,7 +151,7 @@ int main (int argc, char * argv[])
 	initialize_pthread_attr(PTHREAD_CREATE_JOINABLE, SCHED_RR, -10, 
 				PTHREAD_EXPLICIT_SCHED, PTHREAD_SCOPE_SYSTEM, &attr);
 
-	printf ("Running threadtest for %d threads, %d iterations, %d objects, %d work and %d size...\n", nthreads, niterations, nobjects, work, size);
+	printf ("Running threadtest for %d threads, %d iterations, %d objects, %d work, %d size and %d batch...\n", nthreads, niterations, nobjects, work, size, batch);
 
 	/* Get the starting time */
 	clock_gettime(CLOCK_MONOTONIC_RAW, &start_time);
@@ -12,7 +12,15 @@
 #include <stddef.h>
 
 
-#define DSEG_MAX 256*1024*1024  /* 256 Mb */
+/*
+ * The data segment is a range of address space reserved up front and
+ * committed in DSEG_CHUNK pieces as mem_sbrk grows into it. The reservation
+ * costs no memory until used; set MEM_DSEG_MAX in the environment (bytes,
+ * with an optional K, M, G or T suffix) to change its size.
+ */
+#define DSEG_MAX (64L*1024*1024*1024)  /* 64 Gb */
+#define DSEG_CHUNK (4*1024*1024)       /* 4 Mb */
+#define DSEG_ALIGN (2*1024*1024)       /* dseg_lo alignment, for hugepages */
 
 extern char *dseg_lo, *dseg_hi;
 extern long dseg_size;
@@ -21,6 +29,7 @@ extern int mem_init (void);
 extern void *mem_sbrk (ptrdiff_t increment);
 extern int mem_pagesize (void);
 extern ptrdiff_t mem_usage (void);
+extern int mem_release (void *addr, size_t len);
 
 #endif /* __MEMLIB_H_ */
 
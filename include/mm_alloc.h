@@ -0,0 +1,249 @@
+// -*- C++ -*-
+#ifndef _MM_ALLOC_H_
+#define _MM_ALLOC_H_
+
+// C++ on top of the mm_* allocator:
+//
+//   mm::allocator<T>   a standard Allocator, for containers that take one
+//   mm::resource()     a std::pmr::memory_resource, for std::pmr containers
+//   MM_GLOBAL_NEW      define it before including this header in exactly one
+//                      source file of a program to replace the global
+//                      operator new and delete with mm_malloc and friends
+//
+// Whatever knows the size of a block when freeing it, i.e. the allocator, the
+// resource and sized delete, hands it to mm_free_sized. The allocator is
+// initialized on first use, so none of these need mm_init to run first.
+
+#ifndef __cplusplus
+#error "mm_alloc.h is for C++ only; C code uses malloc.h"
+#endif
+
+#include <cstddef>
+#include <limits>
+#include <memory_resource>
+#include <new>
+
+extern "C" {
+#include "malloc.h"
+}
+
+namespace mm {
+
+namespace detail {
+
+// Alignment of every block from mm_malloc that is at least this big.
+constexpr std::size_t DEFAULT_ALIGN = __STDCPP_DEFAULT_NEW_ALIGNMENT__;
+
+inline void init() {
+  static const int ret = mm_init();
+  (void)ret;
+}
+
+// Bytes to ask mm_malloc for so that the block is aligned to [align], which
+// is at most [DEFAULT_ALIGN]: no less than [align], and sizes between 8 and
+// 64 bytes rounded up to a multiple of 16, as some size classes there aren't.
+// Freeing a block by size must pass the same size through here again.
+inline std::size_t block_size(std::size_t n, std::size_t align) {
+  if (n < align)
+    n = align;
+  if (n == 0)
+    return 1;
+  return n > 8 && n < 64 ? (n + 15) & ~std::size_t(15) : n;
+}
+
+inline void *try_allocate(std::size_t n, std::size_t align) {
+  init();
+  if (align <= DEFAULT_ALIGN)
+    return mm_malloc(block_size(n, align));
+  return mm_memalign(align, n ? n : 1);
+}
+
+// Keep calling the new-handler until the allocation succeeds, as operator new
+// does.
+inline void *allocate(std::size_t n, std::size_t align) {
+  for (;;) {
+    void *p = try_allocate(n, align);
+    if (p != nullptr)
+      return p;
+    std::new_handler handler = std::get_new_handler();
+    if (handler == nullptr)
+      throw std::bad_alloc();
+    handler();
+  }
+}
+
+inline void *allocate_nothrow(std::size_t n, std::size_t align) noexcept {
+  try {
+    return allocate(n, align);
+  } catch (...) {
+    return nullptr;
+  }
+}
+
+// Over-aligned blocks come from mm_memalign, whose size class needn't follow
+// from [n], so only the others take the sized path.
+inline void deallocate(void *p, std::size_t n, std::size_t align) noexcept {
+  if (align <= DEFAULT_ALIGN)
+    mm_free_sized(p, block_size(n, align));
+  else
+    mm_free(p);
+}
+
+} // namespace detail
+
+template <class T> class allocator {
+public:
+  typedef T value_type;
+
+  allocator() noexcept {}
+  template <class U> allocator(const allocator<U> &) noexcept {}
+
+  T *allocate(std::size_t n) {
+    if (n > std::numeric_limits<std::size_t>::max() / sizeof(T))
+      throw std::bad_array_new_length();
+    return static_cast<T *>(detail::allocate(n * sizeof(T), alignof(T)));
+  }
+
+  void deallocate(T *p, std::size_t n) noexcept {
+    detail::deallocate(p, n * sizeof(T), alignof(T));
+  }
+};
+
+template <class T, class U>
+inline bool operator==(const allocator<T> &, const allocator<U> &) noexcept {
+  return true;
+}
+
+template <class T, class U>
+inline bool operator!=(const allocator<T> &, const allocator<U> &) noexcept {
+  return false;
+}
+
+class memory_resource final : public std::pmr::memory_resource {
+private:
+  void *do_allocate(std::size_t n, std::size_t align) override {
+    return detail::allocate(n, align);
+  }
+
+  void do_deallocate(void *p, std::size_t n, std::size_t align) override {
+    detail::deallocate(p, n, align);
+  }
+
+  // All instances draw from the same heaps.
+  bool do_is_equal(const std::pmr::memory_resource &other) const
+      noexcept override {
+    return dynamic_cast<const memory_resource *>(&other) != nullptr;
+  }
+};
+
+inline memory_resource *resource() noexcept {
+  static memory_resource instance;
+  return &instance;
+}
+
+} // namespace mm
+
+#ifdef MM_GLOBAL_NEW
+
+// Replacement functions must not be inline, hence the one source file.
+
+void *operator new(std::size_t n) {
+  return mm::detail::allocate(n, mm::detail::DEFAULT_ALIGN);
+}
+
+void *operator new[](std::size_t n) {
+  return mm::detail::allocate(n, mm::detail::DEFAULT_ALIGN);
+}
+
+void *operator new(std::size_t n, const std::nothrow_t &) noexcept {
+  return mm::detail::allocate_nothrow(n, mm::detail::DEFAULT_ALIGN);
+}
+
+void *operator new[](std::size_t n, const std::nothrow_t &) noexcept {
+  return mm::detail::allocate_nothrow(n, mm::detail::DEFAULT_ALIGN);
+}
+
+void *operator new(std::size_t n, std::align_val_t align) {
+  return mm::detail::allocate(n, static_cast<std::size_t>(align));
+}
+
+void *operator new[](std::size_t n, std::align_val_t align) {
+  return mm::detail::allocate(n, static_cast<std::size_t>(align));
+}
+
+void *operator new(std::size_t n, std::align_val_t align,
+                   const std::nothrow_t &) noexcept {
+  return mm::detail::allocate_nothrow(n, static_cast<std::size_t>(align));
+}
+
+void *operator new[](std::size_t n, std::align_val_t align,
+                     const std::nothrow_t &) noexcept {
+  return mm::detail::allocate_nothrow(n, static_cast<std::size_t>(align));
+}
+
+void operator delete(void *p) noexcept {
+  if (p != nullptr)
+    mm_free(p);
+}
+
+void operator delete[](void *p) noexcept {
+  if (p != nullptr)
+    mm_free(p);
+}
+
+void operator delete(void *p, const std::nothrow_t &) noexcept {
+  if (p != nullptr)
+    mm_free(p);
+}
+
+void operator delete[](void *p, const std::nothrow_t &) noexcept {
+  if (p != nullptr)
+    mm_free(p);
+}
+
+void operator delete(void *p, std::size_t n) noexcept {
+  if (p != nullptr)
+    mm::detail::deallocate(p, n, mm::detail::DEFAULT_ALIGN);
+}
+
+void operator delete[](void *p, std::size_t n) noexcept {
+  if (p != nullptr)
+    mm::detail::deallocate(p, n, mm::detail::DEFAULT_ALIGN);
+}
+
+void operator delete(void *p, std::align_val_t) noexcept {
+  if (p != nullptr)
+    mm_free(p);
+}
+
+void operator delete[](void *p, std::align_val_t) noexcept {
+  if (p != nullptr)
+    mm_free(p);
+}
+
+void operator delete(void *p, std::align_val_t,
+                     const std::nothrow_t &) noexcept {
+  if (p != nullptr)
+    mm_free(p);
+}
+
+void operator delete[](void *p, std::align_val_t,
+                       const std::nothrow_t &) noexcept {
+  if (p != nullptr)
+    mm_free(p);
+}
+
+void operator delete(void *p, std::size_t n, std::align_val_t align) noexcept {
+  if (p != nullptr)
+    mm::detail::deallocate(p, n, static_cast<std::size_t>(align));
+}
+
+void operator delete[](void *p, std::size_t n,
+                       std::align_val_t align) noexcept {
+  if (p != nullptr)
+    mm::detail::deallocate(p, n, static_cast<std::size_t>(align));
+}
+
+#endif // MM_GLOBAL_NEW
+
+#endif /* _MM_ALLOC_H_ */
@@ -3,7 +3,9 @@
 #ifndef _MM_THREAD_H_
 #define _MM_THREAD_H_
 
+#ifndef _GNU_SOURCE
 #define _GNU_SOURCE
+#endif
 
 #include <sys/types.h>
 #include <sys/stat.h>
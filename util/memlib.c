@@ -20,13 +20,34 @@ char *dseg_lo = NULL, *dseg_hi = NULL;
 long dseg_size;  /* Maximum size of data segment */
 
 static int page_size;
+static char *dseg_committed;  /* End of the part of the segment usable so far */
 
 /* Align pointer to closest page boundary downwards */
 #define PAGE_ALIGN(p)    ((void *)(((unsigned long)(p) / page_size) * page_size))
 /* Align pointer to closest page boundary upwards */
 #define PAGE_ALIGN_UP(p) ((void *)((((unsigned long)(p) + page_size - 1) / page_size) * page_size))
+/* Round up to a whole number of chunks */
+#define CHUNK_ALIGN_UP(n) ((((n) + DSEG_CHUNK - 1) / DSEG_CHUNK) * DSEG_CHUNK)
 
 
+/* Size of the data segment to reserve, from MEM_DSEG_MAX if set */
+static long dseg_max (void)
+{
+    char *end, *s = getenv("MEM_DSEG_MAX");
+    long size;
+
+    if (!s)
+        return DSEG_MAX;
+    size = strtol(s, &end, 0);
+    switch (*end) {
+    case 't': case 'T': size *= 1024;  /* fall through */
+    case 'g': case 'G': size *= 1024;  /* fall through */
+    case 'm': case 'M': size *= 1024;  /* fall through */
+    case 'k': case 'K': size *= 1024;
+    }
+    return size > 0 ? (long) PAGE_ALIGN_UP(size) : DSEG_MAX;
+}
+
 
 int mem_init (void)
 {
@@ -34,15 +55,26 @@ int mem_init (void)
     /* Get system page size */
     page_size = (int) getpagesize();
 
-    /* Allocate heap */
-    dseg_lo = (char *) malloc(DSEG_MAX + 2*page_size);
-    if (!dseg_lo)
+    /* Reserve address space for the heap; nothing is committed yet */
+    dseg_size = dseg_max();
+    dseg_lo = mmap(NULL, dseg_size + DSEG_ALIGN, PROT_NONE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (dseg_lo == MAP_FAILED) {
+        dseg_lo = NULL;
         return -1;
+    }
+
+    /* Trim the reservation to start on a DSEG_ALIGN boundary */
+    {
+        char *raw = dseg_lo;
+        dseg_lo = (char *)(((unsigned long)raw + DSEG_ALIGN - 1) & ~(DSEG_ALIGN - 1));
+        if (dseg_lo > raw)
+            munmap(raw, dseg_lo - raw);
+        munmap(dseg_lo + dseg_size, raw + DSEG_ALIGN - dseg_lo);
+    }
 
-    /* align heap to the next page boundary */
-    dseg_lo = (char *) PAGE_ALIGN_UP(dseg_lo);
     dseg_hi = dseg_lo-1;
-    dseg_size = DSEG_MAX;
+    dseg_committed = dseg_lo;
 
 
     return 0;
@@ -53,19 +85,41 @@ void *mem_sbrk (ptrdiff_t increment)
 {
     char *new_hi = dseg_hi + increment;
     char *old_hi = dseg_hi;
-    long dseg_cursize = dseg_hi - dseg_lo + 1;
 
     assert(increment > 0);
 
     /* Resize data segment, if the memory is available */
-    if (new_hi > dseg_lo + dseg_size)
+    if (new_hi >= dseg_lo + dseg_size)
         return NULL;
+
+    /* Commit the memory, a chunk at a time */
+    if (new_hi >= dseg_committed) {
+        long len = CHUNK_ALIGN_UP(new_hi + 1 - dseg_committed);
+        if (dseg_committed + len > dseg_lo + dseg_size)
+            len = dseg_lo + dseg_size - dseg_committed;
+        if (mprotect(dseg_committed, len, PROT_READ | PROT_WRITE) == -1)
+            return NULL;
+        dseg_committed += len;
+    }
     dseg_hi = new_hi;
-    dseg_cursize = dseg_hi - dseg_lo + 1;
 
     return (void *)(old_hi + 1);
 }
 
+/*
+ * Give the pages in [addr, addr + len) back to the system. The range stays
+ * part of the segment; it reads back as zeroes and is faulted back in when
+ * next touched.
+ */
+int mem_release (void *addr, size_t len)
+{
+    char *lo = PAGE_ALIGN_UP(addr), *hi = PAGE_ALIGN((char *)addr + len);
+
+    if (hi <= lo)
+        return 0;
+    return madvise(lo, hi - lo, MADV_DONTNEED);
+}
+
 int mem_pagesize (void)
 {
     return page_size;